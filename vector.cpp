@@ -1,6 +1,21 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef TRACE
+#include <iomanip>
+#endif
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #define STB_IMAGE_IMPLEMENTATION
@@ -13,18 +28,107 @@ const bool color_crt_mode = true;
 const bool shadow_mask = false;
 const bool electron_guide = true;           // minimize lost electrons
 
+// without the guide, only electrons landing on an aperture get through the shadow mask
+// rather than throwing the rest away, every electron lands on its aperture weighted by the chance of passing
+const float shadow_mask_transmission = 1.0 / (3 * 4);
+
+// direct raster
+// in color crt mode the beam path is a fixed raster, so instead of sampling it with random electrons
+// each triad of each scanline is visited once and its scattered energy is spread with a precomputed kernel
+// only with the electron guide, which the kernel assumes
+const bool raster_fast_path = true;
+const int raster_kernel_radius = 3;         // in triads and scanlines
+const int raster_kernel_samples = 1 << 20;  // electrons simulated to build the kernel
+const float raster_kernel_threshold = 1e-3; // smallest share of a triad's energy worth depositing
+
+// raster timing, roughly ntsc
+// in color crt mode the beam spends part of each scanline and part of each field retracing
+// blanking takes up frame time but no electrons are spent on it
+const bool raster_timing = true;
+const float hblank_fraction = 10.9 / 63.6;  // of each scanline
+const float vblank_fraction = 20.0 / 262.5; // of each field
+const bool interlace = true;                // odd fields get an extra half line of vblank
+
+// composite video
+// in color crt mode the source can go through a composite encoder and decoder before it reaches the beam
+// luma and chroma share one signal, so fine detail bleeds into color and color edges smear
+enum video_signal {signal_rgb, signal_ntsc, signal_pal};
+video_signal composite_video = signal_rgb;  // --composite ntsc or pal
+const int composite_carrier_cycles = 192;   // color subcarrier cycles per active scanline, sampled 4 times each
+const int composite_luma_taps = 21;         // decoder filters, windowed sinc
+const float composite_luma_cutoff = 0.12;   // in cycles per sample, the subcarrier is at 0.25
+const int composite_chroma_taps = 33;
+const float composite_chroma_cutoff = 0.05;
+
+// electron gun inertia
+// the deflection can't move the beam instantly, it follows the path like a damped spring
+// corners get rounded and overshoot
+const bool gun_inertia = !color_crt_mode;   // the raster sweeps too evenly to show it
+const float gun_frequency = 400;            // natural frequency, in cycles per frame
+const float gun_damping = 0.5;              // damping ratio, below 1 overshoots
+
 // drawing parameters
 const bool light_pen_mode = false;           // follows mouse cursor instead of drawing rotating cube
+const float pen_sample_rate = 1000;          // cursor samples per second, taken on the main thread
+const int pen_ring_size = 1024;              // samples held between frames, a power of two
+const float pen_hit_radius = 8;              // pixels around the pen that it sees the beam in
+const int hit_grid_max = 512;                // cells across the hit grid, at most
 const float drawing_jitter = color_crt_mode ? 0.0000025 : 0;
 
+// curves
+// beziers and arcs are flattened into path segments within curve_tolerance of the curve on screen
+const float curve_tolerance = 0.25;          // in pixels
+const int curve_max_depth = 10;              // subdivisions, a curve gets at most 2^depth segments
+
+// path optimizer
+// reorders and reverses the segments of the path so the beam travels as little as possible between them
+const bool path_optimizer = true;
+const int path_optimizer_window = 32;        // how far apart in the order 2-opt tries reversals
+const int path_optimizer_passes = 4;         // 2-opt passes per frame, at most
+const int path_optimizer_budget = 100000;    // 2-opt reversals tried per frame, at most
+const int path_optimizer_refresh = 60;       // frames before the order is rebuilt from scratch
+const int path_optimizer_max_segments = 10000;  // longer paths are only optimized once they hold still
+
+// blanked moves
+// in vector mode the beam is switched off to move between segments, which takes part of the frame
+// electrons are only fired while drawing, so the whole electron_count goes to the segments
+// the light pen's path is timed this way in either mode, by when the pen was at each sample
+const bool blanked_moves = !color_crt_mode || light_pen_mode;
+const float blank_settle_time = 0.002;      // per move, as a fraction of the frame
+const float blank_speed = 20;               // in screen widths per frame
+const float blank_max_time = 0.9;           // moves are sped up to leave at least the rest for drawing
+
+// electron budget
+// segments get electrons in proportion to their length on screen, so lines are equally bright
+// with equal time instead, every segment gets the same share and short ones are brighter, as the beam is slower
+const bool equal_segment_time = false;
+const float segment_min_length = 1;         // in pixels, so points still get drawn
+
 // power supply parameters
 const float power_supply_smoothing = color_crt_mode ? 0 : 3;    // per frame
 
 // electron beam parameters
-const int electron_count = color_crt_mode ? 120000 : 40000;           // per frame
+int electron_count = color_crt_mode ? 120000 : 40000;                 // per frame; see set_electron_count
 const float electron_intensity = color_crt_mode ? (shadow_mask ? 48000 : 24000) : 500;       // total energy emitted per frame
 const float electron_scattering = color_crt_mode ? 0.05 : 0.25;     // impurity of the beam
 
+// electron accumulation
+// fixed point accumulation lets threads scatter into one shared buffer with relaxed atomic adds
+// the scale leaves room for rounding up to fixed_point_max_electrons deposits into a single pixel
+// no pixel can receive more than electron_intensity in one frame, so it never overflows
+const bool fixed_point_electrons = true;
+const double fixed_point_max_electrons = 1e8;       // per frame
+const double fixed_point_scale = (4294967295.0 - fixed_point_max_electrons) / electron_intensity;
+const int electron_chunks = 64;             // units of work; results don't depend on the thread count
+int electron_threads = std::max (1u, std::thread::hardware_concurrency ());
+
+// binned scatter
+// deposits are collected in batches, counting sorted by screen tile and then applied tile by tile
+// so the buffer writes stay in cache; this pays off with many electrons on large screens
+bool binned_scatter = false;
+const int scatter_batch_size = 1 << 15;     // deposits per batch, per thread
+const int scatter_tile_shift = 7;           // 128x128 pixel tiles
+
 // phosphor parameters
 const bool enable_phosphor_filter = color_crt_mode ? true : true;
 const float phosphor_persistence = color_crt_mode ? 1 : 5;       // divides how much emittance remains after one frame
@@ -53,11 +157,51 @@ const int bloom_kernel_diameter = 10;       // 0 to disable bloom
 const float bloom_brightness = color_crt_mode ? 8 : 15;
 const float bloom_spread = color_crt_mode ? 40 : 100;
 
+// profiling parameters
+const bool enable_gpu_timers = true;        // time the upload and bloom passes with gpu queries
+const int gpu_timer_latency = 4;            // frames to wait before reading a query back
+
+// quality governor
+// holds the frame time to a target by trading electrons on the cpu and bloom size on the gpu
+float governor_target = 0;                  // ms per frame, 0 disables; see --governor
+const float governor_high = 0.9;            // of the target, above this quality is lowered
+const float governor_low = 0.6;             // below this it is raised again
+const int governor_hold = 15;               // frames to wait after a change before the next
+const float governor_smoothing = 0.2;       // weight of the newest frame in the time averages
+const int governor_min_electrons = 5000;
+const int governor_min_bloom = 4;           // bloom diameter
+
+// regression parameters
+// --frames runs a fixed number of frames at a fixed timestep
+// --golden-write and --golden-check save or compare the last frame
+const float fixed_timestep = 1.0 / 60;      // seconds per frame when the frame count is fixed
+const float golden_psnr_tolerance = 40;     // minimum psnr in db
+const float golden_mae_tolerance = 0.001;   // maximum mean absolute error
+
+// microbenchmark parameters
+const int bench_warmup = 5;                 // untimed repetitions before measuring
+const int bench_repetitions = 31;           // timed repetitions per input size
+const int bench_stage_repetitions = 9;      // for whole frame stages, which are much slower
+const float bench_outlier_cutoff = 3;       // reject repetitions further than this many MADs from the median
+const int bench_sizes[] = { 1 << 8, 1 << 12, 1 << 16 };
+const int bench_resolutions[][2] = { { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 } };
+const int bench_electron_counts[] = { 40000, 400000, 2000000 };
+
 // screen dimensions
-// TODO: allow screen resizing
-const int width = 256 * 3;
-const int height = 144 * 4;
-const int size = width * height;
+// these are the defaults; --resolution and window resizing change them at runtime
+// in color crt mode they should be multiples of 3 and 4 to fit whole triads
+int width = 256 * 3;
+int height = 144 * 4;
+int size = width * height;
+
+// phosphor stage bands
+// the screen is processed in bands of rows, which are handed out to the electron threads
+const int phosphor_band_bytes = 256 << 10;
+
+// buffer allocation
+const size_t buffer_alignment = 64;         // cache line
+const bool use_huge_pages = false;          // back the screen buffers with transparent huge pages
+const size_t huge_page_size = 2 << 20;
 
 // 4x4 matrix representation
 struct mat4 {
@@ -116,6 +260,18 @@ struct mat4 {
 
         return result;
     }
+
+    // apply to count points at once, kept in separate coordinate arrays so the loops vectorize
+    // one pass per output coordinate, a single pass writing all three doesn't vectorize
+    void transform (int count, const float *x, const float *y, const float *z,
+                    float *out_x, float *out_y, float *out_z) {
+        for (int i = 0; i < count; i++)
+            out_x[i] = x[i] * xx + y[i] * xy + z[i] * xz + xw;
+        for (int i = 0; i < count; i++)
+            out_y[i] = x[i] * yx + y[i] * yy + z[i] * yz + yw;
+        for (int i = 0; i < count; i++)
+            out_z[i] = x[i] * zx + y[i] * zy + z[i] * zz + zw;
+    }
 };
 
 // 2d vector representation
@@ -142,9 +298,9 @@ struct vec3 {
     vec3 operator * (mat4 m) {
         vec3 result;
 
-        result.x = x * m.xx + y * m.xy + z * m.xz;
-        result.y = x * m.yx + y * m.yy + z * m.yz;
-        result.z = x * m.zx + y * m.zy + z * m.zz;
+        result.x = x * m.xx + y * m.xy + z * m.xz + m.xw;
+        result.y = x * m.yx + y * m.yy + z * m.yz + m.yw;
+        result.z = x * m.zx + y * m.zy + z * m.zz + m.zw;
 
         return result;
     }
@@ -159,7 +315,7 @@ mat4 translate (float x, float y, float z) {
 }
 
 mat4 rotate_z (float angle) {
-    return mat4 (cos (angle), -sin (angle), 0, 1, sin (angle), cos (angle), 0, 1, 0, 0, 0, 1, 0, 0, 0, 1);
+    return mat4 (cos (angle), -sin (angle), 0, 0, sin (angle), cos (angle), 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
 }
 
 mat4 rotate_y (float angle) {
@@ -171,65 +327,273 @@ mat4 rotate_x (float angle) {
 }
 
 // precalculations
-const float intensity_per_electron = electron_intensity / electron_count;
-const float electron_delta = 1.0 / electron_count;
+float intensity_per_electron;
+float electron_delta;
+float power_supply_decay;
+int beam_steps;                 // equal slices of the frame, electron_count of them drawing
 const float phosphor_decay = 1.0 / (1 + phosphor_persistence);
-const float power_supply_decay = 1.0 / (1 + power_supply_smoothing) / electron_count;
-const int bloom_kernel_radius = bloom_kernel_diameter / 2;
 const int bloom_kernel_size = bloom_kernel_diameter * bloom_kernel_diameter;
-const float center_x = width / 2.0;
-const float center_y = height / 2.0;
+int bloom_diameter = bloom_kernel_diameter;     // in use, the governor may shrink it
+float bloom_kernel_sum;                         // total weight at the full diameter
+float center_x = width / 2.0;
+float center_y = height / 2.0;
+
+// change the number of electrons per frame
+// the total energy per frame stays the same
+void set_electron_count (int count) {
+    electron_count = count;
+    intensity_per_electron = electron_intensity / electron_count;
+    electron_delta = 1.0 / electron_count;
+    power_supply_decay = 1.0 / (1 + power_supply_smoothing) / electron_count;
+    beam_steps = electron_count;
+}
 
 // state variables
 float power_supply_in = 1;      // power input; 1 = normal, 0 = off
 float power_supply_out = 0;     // smoothed output of power supply
-float color_red = 1;            // current value for red beam
-float color_green = 1;          // current value for red beam
-float color_blue = 1;           // current value for red beam
+double last_frame_clock = 0;    // wall clock time of the previous frame
+thread_local float color_red = 1;      // current value for red beam
+thread_local float color_green = 1;    // current value for red beam
+thread_local float color_blue = 1;     // current value for red beam
 int frame = 0;                  // the frame counter
 
 // normalized mouse coordinates
 vec2 mouse;
-vec2 previous_mouse;
+
+// light pen samples
+// the main thread writes them continuously and the render thread reads them when it builds a frame's path
+// single producer and single consumer, so the two counters are all the synchronization
+struct pen_sample {
+    vec2 position;
+    double time;
+};
+pen_sample pen_ring[pen_ring_size];
+std::atomic <uint32_t> pen_ring_head = 0;   // next to write
+std::atomic <uint32_t> pen_ring_tail = 0;   // next to read
+pen_sample pen_last = { vec2 (), -1 };      // end of the path drawn so far, negative time before the first
+std::vector <float> pen_duration;           // seconds between the samples of each path segment
+
+void push_pen_sample (vec2 position, double time) {
+    uint32_t head = pen_ring_head.load (std::memory_order_relaxed);
+    if (head - pen_ring_tail.load (std::memory_order_acquire) == pen_ring_size)
+        return;
+    pen_ring[head % pen_ring_size] = { position, time };
+    pen_ring_head.store (head + 1, std::memory_order_release);
+}
 
 // electron buffer
 // new electrons hitting the screen
 // adjusted for decay after time hit between current and last frame
-float electron_buffer[size];
+// only one of these is allocated depending on fixed_point_electrons
+float *electron_buffer;
+uint32_t *electron_fixed;
 
 // phosphor buffer
 // total emittance of phosphor at each pixel
 // rgb color
-float phosphor_buffer[size * 3];
+float *phosphor_buffer;
 
 // phoshor colors
-float color_mask[size * 3];
+// the mask repeats vertically, so only one period of rows is stored
+// followed by a blank row for any partial triad rows at the bottom
+float *color_mask;
+const int color_mask_rows = color_crt_mode ? 4 : 1;
 
 // convolution kernel for bloom shader
 float kernel[bloom_kernel_size];
 
 // the image to render in color crt mode
-float image[size * 3];
+std::vector <float> image;
+int image_width = 0;
+int image_height = 0;
 
 // the 3d path for the electron beam to trace
-vec3 path[1024];
-int vertex_count = 0;
+std::vector <vec3> path;
+bool path_reordered = false;    // whether the optimizer reordered it this frame, see path_order
+
+// segments of a loaded svg, drawn instead of the cube
+std::vector <vec3> svg_path;
 
 // opengl stuff
 GLuint vbo, vao, program;
 GLuint phosphor_texture, kernel_texture;
 
+// stage tracing
+// build with -DTRACE to record scoped timers into a ring buffer
+// press T to dump the most recent events as chrome trace json (chrome://tracing or ui.perfetto.dev)
+#ifdef TRACE
+const int trace_capacity = 1 << 16;         // events kept, oldest are overwritten
+const char *trace_filename = "trace.json";
+const int trace_gpu_thread = 1000;          // gpu timings are shown on their own track
+
+struct trace_event {
+    const char *name;
+    long long start;        // ns since the trace epoch
+    long long duration;     // ns
+    int thread;
+};
+
+trace_event trace_events[trace_capacity];
+std::atomic <unsigned long long> trace_head (0);        // total events ever recorded
+const auto trace_epoch = std::chrono::steady_clock::now ();
+std::atomic <int> trace_thread_count (0);
+thread_local int trace_thread = trace_thread_count++;
+
+long long trace_now () {
+    return std::chrono::duration_cast <std::chrono::nanoseconds> (std::chrono::steady_clock::now () - trace_epoch).count ();
+}
+
+void trace_record (const char *name, long long start, long long duration, int thread = trace_thread) {
+    // claim a slot without locking; slots are reused once the ring wraps
+    trace_event &event = trace_events[trace_head.fetch_add (1, std::memory_order_relaxed) % trace_capacity];
+    event.name = name;
+    event.start = start;
+    event.duration = duration;
+    event.thread = thread;
+}
+
+// records the lifetime of the enclosing scope
+struct trace_scope {
+    const char *name;
+    long long start;
+    trace_scope (const char *name) : name (name), start (trace_now ()) {}
+    ~trace_scope () {
+        trace_record (name, start, trace_now () - start);
+    }
+};
+
+void dump_trace () {
+    std::ofstream out (trace_filename);
+    out << std::fixed << std::setprecision (3);     // microseconds
+    out << "{\"traceEvents\":[\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << trace_gpu_thread << ",\"args\":{\"name\":\"gpu\"}}";
+    unsigned long long head = trace_head.load (std::memory_order_acquire);
+    unsigned long long first = head > trace_capacity ? head - trace_capacity : 0;
+    for (unsigned long long i = first; i < head; i++) {
+        const trace_event &event = trace_events[i % trace_capacity];
+        out << ",\n"
+            << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+            << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << event.duration / 1000.0 << "}";
+    }
+    out << "\n]}\n";
+    std::cerr << "Wrote " << head - first << " trace events to " << trace_filename << std::endl;
+}
+
+#define TRACE_CONCAT_(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_ (a, b)
+#define TRACE_SCOPE(name) trace_scope TRACE_CONCAT (trace_scope_, __LINE__) (name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
+// gpu timer queries
+// each frame uses its own set of queries from a small pool
+// they are read back gpu_timer_latency frames later so the cpu never waits on the gpu
+enum gpu_stage {
+    gpu_upload,
+    gpu_bloom,
+    gpu_stage_count
+};
+const char *gpu_stage_names[gpu_stage_count] = { "gpu upload", "gpu bloom" };
+GLuint gpu_queries[gpu_timer_latency][gpu_stage_count];
+bool gpu_query_pending[gpu_timer_latency][gpu_stage_count];
+double gpu_stage_time[gpu_stage_count];     // most recent result in ms
+
+// quality governor state
+// the time averages it decides on and its last decision; the settings themselves are
+// electron_count and bloom_diameter
+struct governor_state {
+    double cpu_time = 0;            // averages, in ms
+    double emit_time = 0;
+    double gpu_time = 0;
+    bool electrons_governed = false;    // only when tracing electrons, the raster kernel's cost doesn't depend on them
+    int last_change = -1;           // frame of the last decision
+    const char *last_knob = NULL;   // "electrons" or "bloom"
+};
+governor_state governor;
+#ifdef TRACE
+long long gpu_query_start[gpu_timer_latency][gpu_stage_count];
+#endif
+
+void init_gpu_timers () {
+    if (enable_gpu_timers)
+        glGenQueries (gpu_timer_latency * gpu_stage_count, &gpu_queries[0][0]);
+}
+
+void begin_gpu_timer (gpu_stage stage) {
+    if (!enable_gpu_timers)
+        return;
+    int slot = frame % gpu_timer_latency;
+    glBeginQuery (GL_TIME_ELAPSED, gpu_queries[slot][stage]);
+    gpu_query_pending[slot][stage] = true;
+#ifdef TRACE
+    gpu_query_start[slot][stage] = trace_now ();
+#endif
+}
+
+void end_gpu_timer () {
+    if (enable_gpu_timers)
+        glEndQuery (GL_TIME_ELAPSED);
+}
+
+// collect the queries issued gpu_timer_latency frames ago before their slot is reused
+void collect_gpu_timers () {
+    if (!enable_gpu_timers)
+        return;
+    int slot = frame % gpu_timer_latency;
+    for (int stage = 0; stage < gpu_stage_count; stage++) {
+        if (!gpu_query_pending[slot][stage])
+            continue;
+        gpu_query_pending[slot][stage] = false;
+
+        // if the gpu is still behind, drop the sample rather than stall
+        GLuint available = 0;
+        glGetQueryObjectuiv (gpu_queries[slot][stage], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            continue;
+        GLuint64 elapsed;
+        glGetQueryObjectui64v (gpu_queries[slot][stage], GL_QUERY_RESULT, &elapsed);
+        gpu_stage_time[stage] = elapsed / 1e6;
+#ifdef TRACE
+        trace_record (gpu_stage_names[stage], gpu_query_start[slot][stage], elapsed, trace_gpu_thread);
+#endif
+    }
+}
+
+// random numbers
+// each chunk of electrons reseeds its own stream so results don't depend on scheduling
+unsigned int noise_seed = 0;
+thread_local uint32_t noise_state = 1;
+
+void seed_noise (unsigned int chunk) {
+    // splitmix style hash of the seed, frame and chunk
+    uint64_t z = ((uint64_t) noise_seed << 32 ^ (uint64_t) frame << 8 ^ chunk) + 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    noise_state = (z ^ (z >> 31)) | 1;
+}
+
 float noise () {
-    return (float) rand () / RAND_MAX;
+    // xorshift32
+    noise_state ^= noise_state << 13;
+    noise_state ^= noise_state >> 17;
+    noise_state ^= noise_state << 5;
+    return (noise_state >> 8) * (1.0f / 16777216);
 }
 
 // sample the path for the electron beam to trace per frame
 // project to 2d
 // 0 <= n <= 1
-// TODO: add bezier smoothing or something
-// TODO: vblank simulation in color crt mode
 // TODO: phase drift
+vec2 sample_segment (int segment, float n) {
+    vec3 p1 = path[segment * 2];
+    vec3 p2 = path[segment * 2 + 1];
+    vec3 delta = vec3 ((p2.x - p1.x) * n, (p2.y - p1.y) * n, (p2.z - p1.z) * n);
+    return vec3 (p1.x + delta.x, p1.y + delta.y, p1.z + delta.z).project ().map ();
+}
+
 vec2 sample_path (float n) {
+    int vertex_count = path.size ();
     if (vertex_count == 0)
         return vec2 ().map ();
     else if (vertex_count == 1)
@@ -237,18 +601,13 @@ vec2 sample_path (float n) {
 
     float n2 = n * (vertex_count / 2);
     int i = floor (n2);
-    n = n2 - i;
-    i *= 2;
-    vec3 p1 = path[i];
-    vec3 p2 = path[i + 1];
-    vec3 delta = vec3 ((p2.x - p1.x) * n, (p2.y - p1.y) * n, (p2.z - p1.z) * n);
-    return vec3 (p1.x + delta.x, p1.y + delta.y, p1.z + delta.z).project ().map ();
+    return sample_segment (i, n2 - i);
 }
 
 // generate the delta gun pattern
 void generate_color_mask () {
     if (color_crt_mode) {
-        for (int y = 0; y < height / 4; y++) {
+        for (int y = 0; y < std::min (1, height / 4); y++) {
             for (int x = 0; x < width / 3; x++) {
                 int px = x * 3;
                 int py = y * 4;
@@ -282,7 +641,7 @@ void generate_color_mask () {
             }
         }
     } else {
-        for (int i = 0; i < size * 3; i += 3) {
+        for (int i = 0; i < width * color_mask_rows * 3; i += 3) {
             color_mask[i + 0] = phosphor_emittance_red;
             color_mask[i + 1] = phosphor_emittance_green;
             color_mask[i + 2] = phosphor_emittance_blue;
@@ -290,25 +649,369 @@ void generate_color_mask () {
     }
 }
 
+// allocate a zeroed screen buffer on a cache line boundary
+// optionally ask for transparent huge pages to cut tlb misses on large screens
+template <typename T = float>
+T *allocate_buffer (size_t count) {
+    size_t alignment = use_huge_pages ? huge_page_size : buffer_alignment;
+    size_t bytes = (count * sizeof (T) + alignment - 1) / alignment * alignment;
+    T *buffer = (T *) aligned_alloc (alignment, bytes);
+    if (buffer == NULL) {
+        std::cerr << "Could not allocate " << bytes << " bytes" << std::endl;
+        exit (EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    if (use_huge_pages)
+        madvise (buffer, bytes, MADV_HUGEPAGE);
+#endif
+    std::fill_n (buffer, count, 0);
+    return buffer;
+}
+
+// change the simulation resolution, reallocating the screen buffers
+// the phosphor starts dark again
+void set_resolution (int w, int h) {
+    width = w;
+    height = h;
+    size = width * height;
+    center_x = width / 2.0;
+    center_y = height / 2.0;
+
+    free (electron_buffer);
+    free (electron_fixed);
+    free (phosphor_buffer);
+    free (color_mask);
+    electron_buffer = NULL;
+    electron_fixed = NULL;
+    if (fixed_point_electrons)
+        electron_fixed = allocate_buffer <uint32_t> (size);
+    else
+        electron_buffer = allocate_buffer (size);
+    phosphor_buffer = allocate_buffer (size * 3);
+    color_mask = allocate_buffer (width * (color_mask_rows + 1) * 3);
+    generate_color_mask ();
+}
+
 // generate the convolution kernel to pass to the bloom shader
-void generate_kernel () {
-    for (int i = 0; i < bloom_kernel_size; i++) {
-        float x = i % bloom_kernel_diameter;
-        float y = i / bloom_kernel_diameter;
-        float offset_x = x - bloom_kernel_radius;
-        float offset_y = y - bloom_kernel_radius;
-        float radius = sqrt (offset_x * offset_x + offset_y * offset_y) / bloom_kernel_diameter;
+// returns the total weight
+float generate_kernel () {
+    float sum = 0;
+    for (int i = 0; i < bloom_diameter * bloom_diameter; i++) {
+        float x = i % bloom_diameter;
+        float y = i / bloom_diameter;
+        float offset_x = x - bloom_diameter / 2;
+        float offset_y = y - bloom_diameter / 2;
+        float radius = sqrt (offset_x * offset_x + offset_y * offset_y) / bloom_diameter;
         float value = pow (radius, 1.0 / bloom_spread);
         kernel[i] = fmax (0, 1 - value);
+        sum += kernel[i];
+    }
+    return sum;
+}
+
+// curve flattening
+// curves are given by control points and a transform, and flattened once per frame into path segments
+// the flattening is cached by the order curves are added in, and reused while a curve,
+// its transform and the resolution stay the same, which they do for most content most frames
+enum curve_type {curve_quadratic, curve_cubic, curve_arc};
+
+struct curve_key {
+    curve_type type;
+    vec3 points[4];         // control points, or for arcs the center, two axes and (start, end, 0) angles
+    mat4 transform;
+    int width;              // tolerance is in pixels, so the resolution matters too
+    int height;
+};
+
+struct flattened_curve {
+    curve_key key;
+    std::vector <vec3> points;      // transformed, ready for the path
+};
+
+std::vector <flattened_curve> curve_cache;
+int curve_cache_next = 0;           // entry for the next curve added this frame
+
+vec3 mix (vec3 a, vec3 b, float t) {
+    return vec3 (a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
+// distance in pixels of p from the line through a and b
+// to the chord itself, not the line through it, so control points beyond the ends don't count as flat
+float chord_distance (vec2 p, vec2 a, vec2 b) {
+    float dx = b.x - a.x;
+    float dy = b.y - a.y;
+    float length = dx * dx + dy * dy;
+    float n = length > 0 ? std::clamp (((p.x - a.x) * dx + (p.y - a.y) * dy) / length, 0.0f, 1.0f) : 0;
+    return hypot (a.x + dx * n - p.x, a.y + dy * n - p.y);
+}
+
+// subdivide at the middle until the control points are within tolerance of the chord on screen
+// appends every point after the first
+void flatten_bezier (vec3 *control, int order, int depth, std::vector <vec3> &points) {
+    vec2 first = control[0].project ().map ();
+    vec2 last = control[order].project ().map ();
+    bool flat = true;
+    for (int i = 1; i < order; i++)
+        flat = flat && chord_distance (control[i].project ().map (), first, last) <= curve_tolerance;
+    if (flat || depth >= curve_max_depth) {
+        points.push_back (control[order]);
+        return;
+    }
+
+    // de casteljau
+    vec3 left[4], right[4], work[4];
+    std::copy (control, control + order + 1, work);
+    for (int level = 0; level <= order; level++) {
+        left[level] = work[0];
+        right[order - level] = work[order - level];
+        for (int i = 0; i < order - level; i++)
+            work[i] = mix (work[i], work[i + 1], 0.5);
+    }
+    flatten_bezier (left, order, depth + 1, points);
+    flatten_bezier (right, order, depth + 1, points);
+}
+
+// evenly spaced points, as many as the arc's radius on screen needs
+void flatten_arc (curve_key key, std::vector <vec3> &points) {
+    vec3 center = key.points[0];
+    vec3 end_u = vec3 (center.x + key.points[1].x, center.y + key.points[1].y, center.z + key.points[1].z) * key.transform;
+    vec3 end_v = vec3 (center.x + key.points[2].x, center.y + key.points[2].y, center.z + key.points[2].z) * key.transform;
+    center = center * key.transform;
+    vec3 axis_u = vec3 (end_u.x - center.x, end_u.y - center.y, end_u.z - center.z);
+    vec3 axis_v = vec3 (end_v.x - center.x, end_v.y - center.y, end_v.z - center.z);
+    float start = key.points[3].x;
+    float end = key.points[3].y;
+
+    vec2 c = center.project ().map ();
+    vec2 u = end_u.project ().map ();
+    vec2 v = end_v.project ().map ();
+    float radius = fmax (hypot (u.x - c.x, u.y - c.y), hypot (v.x - c.x, v.y - c.y));
+
+    // a chord of angle a is off by radius * (1 - cos (a / 2))
+    int segments = 1;
+    if (radius > curve_tolerance) {
+        float step = 2 * acos (1 - curve_tolerance / radius);
+        segments = std::clamp ((int) ceil (fabs (end - start) / step), 1, 1 << curve_max_depth);
+    }
+    for (int i = 0; i <= segments; i++) {
+        float angle = start + (end - start) * i / segments;
+        float cosine = cos (angle);
+        float sine = sin (angle);
+        points.push_back (vec3 (center.x + axis_u.x * cosine + axis_v.x * sine,
+                                center.y + axis_u.y * cosine + axis_v.y * sine,
+                                center.z + axis_u.z * cosine + axis_v.z * sine));
+    }
+}
+
+// add a curve to the path as consecutive segments
+void add_curve (curve_key key) {
+    if (curve_cache_next == (int) curve_cache.size ())
+        curve_cache.emplace_back ();
+    flattened_curve &cached = curve_cache[curve_cache_next++];
+
+    if (cached.points.empty () || memcmp (&cached.key, &key, sizeof key) != 0) {
+        cached.key = key;
+        cached.points.clear ();
+        if (key.type == curve_arc) {
+            flatten_arc (key, cached.points);
+        } else {
+            int order = key.type == curve_quadratic ? 2 : 3;
+            vec3 control[4];
+            for (int i = 0; i <= order; i++)
+                control[i] = key.points[i] * key.transform;
+            cached.points.push_back (control[0]);
+            flatten_bezier (control, order, 0, cached.points);
+        }
+    }
+
+    for (int i = 0; i + 1 < (int) cached.points.size (); i++) {
+        path.push_back (cached.points[i]);
+        path.push_back (cached.points[i + 1]);
+    }
+}
+
+curve_key make_curve_key (curve_type type, mat4 transform) {
+    curve_key key {};
+    key.type = type;
+    key.transform = transform;
+    key.width = width;
+    key.height = height;
+    return key;
+}
+
+void add_quadratic (vec3 p0, vec3 p1, vec3 p2, mat4 transform = mat4 ()) {
+    curve_key key = make_curve_key (curve_quadratic, transform);
+    key.points[0] = p0;
+    key.points[1] = p1;
+    key.points[2] = p2;
+    add_curve (key);
+}
+
+void add_cubic (vec3 p0, vec3 p1, vec3 p2, vec3 p3, mat4 transform = mat4 ()) {
+    curve_key key = make_curve_key (curve_cubic, transform);
+    key.points[0] = p0;
+    key.points[1] = p1;
+    key.points[2] = p2;
+    key.points[3] = p3;
+    add_curve (key);
+}
+
+// the points center + axis_u * cos (angle) + axis_v * sin (angle) from start to end angle
+void add_arc (vec3 center, vec3 axis_u, vec3 axis_v, float start, float end, mat4 transform = mat4 ()) {
+    curve_key key = make_curve_key (curve_arc, transform);
+    key.points[0] = center;
+    key.points[1] = axis_u;
+    key.points[2] = axis_v;
+    key.points[3] = vec3 (start, end, 0);
+    add_curve (key);
+}
+
+// meshes
+// vertices are kept in separate coordinate arrays and edges as pairs of vertex indices
+// each object in a scene is transformed in one batch and its edges added to the path
+struct mesh {
+    std::vector <float> x;
+    std::vector <float> y;
+    std::vector <float> z;
+    std::vector <int> edges;
+};
+
+// vertex i is at (i & 4, i & 2, i & 1), scaled to -1 and 1
+mesh cube = {
+    { -1, -1, -1, -1, 1, 1, 1, 1 },
+    { -1, -1, 1, 1, -1, -1, 1, 1 },
+    { -1, 1, -1, 1, -1, 1, -1, 1 },
+    { 0, 1, 2, 3, 4, 5, 6, 7,
+      0, 2, 1, 3, 4, 6, 5, 7,
+      0, 4, 1, 5, 2, 6, 3, 7 },
+};
+
+// transformed vertices of the current object
+std::vector <float> mesh_x;
+std::vector <float> mesh_y;
+std::vector <float> mesh_z;
+
+void add_mesh (const mesh &shape, mat4 transform) {
+    int vertex_count = shape.x.size ();
+    mesh_x.resize (vertex_count);
+    mesh_y.resize (vertex_count);
+    mesh_z.resize (vertex_count);
+    transform.transform (vertex_count, shape.x.data (), shape.y.data (), shape.z.data (),
+                         mesh_x.data (), mesh_y.data (), mesh_z.data ());
+
+    int first = path.size ();
+    int edge_vertices = shape.edges.size ();
+    path.resize (first + edge_vertices);
+    for (int i = 0; i < edge_vertices; i++) {
+        int vertex = shape.edges[i];
+        path[first + i] = vec3 (mesh_x[vertex], mesh_y[vertex], mesh_z[vertex]);
+    }
+}
+
+// stroke font
+// each glyph is a string of points on a grid 4 wide and 6 tall, as digit pairs x then y,
+// drawn as connected strokes with | lifting the pen
+// lowercase is drawn as uppercase, and characters without a glyph are left blank
+struct font_glyph {
+    char character;
+    const char *strokes;
+};
+
+const font_glyph font_glyphs[] = {
+    { '0', "0040460600|0046" }, { '1', "152620|0040" }, { '2', "05163645440040" }, { '3', "06464000|1343" },
+    { '4', "060343|3630" }, { '5', "4606043443413000" }, { '6', "460600404303" }, { '7', "064610" },
+    { '8', "0040460600|0343" }, { '9', "430306464000" },
+    { 'A', "002640|1333" }, { 'B', "00063645443303|3342413000" }, { 'C', "46060040" }, { 'D', "00062644422000" },
+    { 'E', "46060040|0333" }, { 'F', "460600|0333" }, { 'G', "460600404323" }, { 'H', "0006|4046|0343" },
+    { 'I', "0646|2620|0040" }, { 'J', "4641301001" }, { 'K', "0006|460340" }, { 'L', "060040" },
+    { 'M', "0006234640" }, { 'N', "00064046" }, { 'O', "0040460600" }, { 'P', "0006464303" },
+    { 'Q', "0040460600|2240" }, { 'R', "000646430340" }, { 'S', "460603434000" }, { 'T', "0646|2620" },
+    { 'U', "06004046" }, { 'V', "062046" }, { 'W', "0600234046" }, { 'X', "0046|0640" },
+    { 'Y', "062346|2320" }, { 'Z', "06460040" },
+    { '.', "2021" }, { ',', "2110" }, { ':', "2122|2425" }, { ';', "2425|2210" }, { '-', "0343" },
+    { '+', "0343|2125" }, { '=', "0242|0444" }, { '/', "0046" }, { '\\', "0640" }, { '!', "2622|2120" },
+    { '?', "05163645442322|2120" }, { '(', "36242230" }, { ')', "16242210" }, { '[', "36161030" },
+    { ']', "16363010" }, { '<', "452341" }, { '>', "052301" }, { '_', "0040" }, { '\'', "2624" },
+    { '"', "1614|3634" }, { '*', "2125|0442|0244" }, { '#', "1115|3135|0242|0444" }, { '%', "0046|0515|3141" },
+};
+
+const float font_advance = 6.0 / 6;         // per character, in heights of a capital
+const float font_line_spacing = 10.0 / 6;   // per line
+
+// glyph strokes as segment pairs, scaled to a capital 1 tall
+std::vector <vec2> font_segments[128];
+
+void generate_font () {
+    for (const font_glyph &glyph : font_glyphs) {
+        std::vector <vec2> &segments = font_segments[(int) glyph.character];
+        const char *c = glyph.strokes;
+        bool pen_down = false;
+        vec2 previous;
+        while (*c) {
+            if (*c == '|') {
+                pen_down = false;
+                c++;
+                continue;
+            }
+            vec2 point ((c[0] - '0') / 6.0, (c[1] - '0') / 6.0);
+            if (pen_down) {
+                segments.push_back (previous);
+                segments.push_back (point);
+            }
+            previous = point;
+            pen_down = true;
+            c += 2;
+        }
+    }
+}
+
+// add text to the path, starting with the baseline of the first character at x, y
+// size is the height of a capital, in normalized screen coordinates, and lines go downward
+void add_text (const char *text, float x, float y, float size) {
+    float left = x;
+    for (const char *c = text; *c; c++) {
+        if (*c == '\n') {
+            x = left;
+            y -= size * font_line_spacing;
+            continue;
+        }
+        int character = toupper ((unsigned char) *c);
+        if (character < 128) {
+            for (vec2 point : font_segments[character])
+                path.push_back (vec3 (x + point.x * size, y + point.y * size, 0));
+        }
+        x += size * font_advance;
     }
 }
 
 void prepare_path (float time) {
-    vertex_count = 0;
+    TRACE_SCOPE ("prepare_path");
+    path.clear ();
+    path_reordered = false;
+    curve_cache_next = 0;
 
     if (light_pen_mode) {
-        path[vertex_count++] = vec3 (previous_mouse);
-        path[vertex_count++] = vec3 (mouse);
+        // the pen's movement since the last frame, in the order it was sampled
+        pen_duration.clear ();
+        uint32_t head = pen_ring_head.load (std::memory_order_acquire);
+        uint32_t tail = pen_ring_tail.load (std::memory_order_relaxed);
+        for (; tail != head; tail++) {
+            pen_sample sample = pen_ring[tail % pen_ring_size];
+            if (pen_last.time >= 0) {
+                path.push_back (vec3 (pen_last.position));
+                path.push_back (vec3 (sample.position));
+                pen_duration.push_back (sample.time - pen_last.time);
+            }
+            pen_last = sample;
+        }
+        pen_ring_tail.store (tail, std::memory_order_release);
+
+        // a pen that hasn't moved is held still
+        if (path.empty ()) {
+            path.push_back (vec3 (pen_last.position));
+            path.push_back (vec3 (pen_last.position));
+            pen_duration.push_back (1);
+        }
         return;
     }
 
@@ -316,231 +1019,1388 @@ void prepare_path (float time) {
         // prepare scanlines
         for (int i = height - 4; i >= 0; i -= 4) {
             float y = (float) (i + 2) / height * 2 - 1;
-            path[vertex_count++] = vec3 (-1, y, 0);
-            path[vertex_count++] = vec3 (1, y, 0);
+            path.push_back (vec3 (-1, y, 0));
+            path.push_back (vec3 (1, y, 0));
         }
     } else {
 
-        // rotating cube
+        if (!svg_path.empty ()) {
+            path.insert (path.end (), svg_path.begin (), svg_path.end ());
+            return;
+        }
 
-        // normalized vertices
-        vec3 p000 = vec3 (-1, -1, -1);
-        vec3 p001 = vec3 (-1, -1, 1);
-        vec3 p010 = vec3 (-1, 1, -1);
-        vec3 p011 = vec3 (-1, 1, 1);
-        vec3 p100 = vec3 (1, -1, -1);
-        vec3 p101 = vec3 (1, -1, 1);
-        vec3 p110 = vec3 (1, 1, -1);
-        vec3 p111 = vec3 (1, 1, 1);
-
-        // transformed vertices
+        // rotating cube
         mat4 transform = mat4 () * scale (0.3, 0.3, 0.3);
         float angle = time * M_PI * 2 / 8;
         transform = transform * rotate_y (angle);
         transform = transform * rotate_x (angle);
-        vec3 p000_ = p000 * transform;
-        vec3 p001_ = p001 * transform;
-        vec3 p010_ = p010 * transform;
-        vec3 p011_ = p011 * transform;
-        vec3 p100_ = p100 * transform;
-        vec3 p101_ = p101 * transform;
-        vec3 p110_ = p110 * transform;
-        vec3 p111_ = p111 * transform;
-
-        // edges
-        path[vertex_count++] = p000_;
-        path[vertex_count++] = p001_;
-        path[vertex_count++] = p010_;
-        path[vertex_count++] = p011_;
-        path[vertex_count++] = p100_;
-        path[vertex_count++] = p101_;
-        path[vertex_count++] = p110_;
-        path[vertex_count++] = p111_;
-
-        path[vertex_count++] = p000_;
-        path[vertex_count++] = p010_;
-        path[vertex_count++] = p001_;
-        path[vertex_count++] = p011_;
-        path[vertex_count++] = p100_;
-        path[vertex_count++] = p110_;
-        path[vertex_count++] = p101_;
-        path[vertex_count++] = p111_;
-
-        path[vertex_count++] = p000_;
-        path[vertex_count++] = p100_;
-        path[vertex_count++] = p001_;
-        path[vertex_count++] = p101_;
-        path[vertex_count++] = p010_;
-        path[vertex_count++] = p110_;
-        path[vertex_count++] = p011_;
-        path[vertex_count++] = p111_;
+        add_mesh (cube, transform);
     }
 }
 
-void sample_color (float n) {
-    float nn = n * height / 4;
-    int line = floor (nn);  // the scanline
-    int y = floor (line * 2 / 3) + (frame % 2 == 0 ? 0 : 1);
-    int x = floor ((nn - line) * width) / 3;
-    int i = (x + y * width) * 3;
-    color_red = image[i];
-    color_green = image[i + 1];
-    color_blue = image[i + 2];
+// path optimizer
+// the segments are ordered greedily, always going to the nearest free end of another segment,
+// found through a grid of segment ends, then improved by 2-opt: reversing a run of segments,
+// and each segment in it, whenever that shortens the jumps at both ends of the run
+// the jump from the last segment back to the first counts too, as the blanked moves draw it
+// the order is kept between frames, and while the number of segments stays the same
+// only the 2-opt passes run on it, since the geometry moves little from frame to frame
+// they try a bounded number of reversals per frame, and the next frame carries on where they stopped
+// a path that didn't change at all, like a loaded svg, reuses the last result as it is
+// rebuilding the greedy order of a long path takes longer than a frame, so a moving one is drawn
+// as it is given, and it is optimized on the first frame it repeats
+std::vector <vec3> path_optimizer_input;
+std::vector <vec3> path_optimizer_output;
+std::vector <int> path_order;               // segment drawn at each position
+std::vector <char> path_reversed;           // whether it is drawn end to start
+int path_order_age = 0;                     // frames since the order was built
+int path_order_cursor = 0;                  // position 2-opt carries on from
+
+// screen positions where the segment at each position starts and ends, as drawn
+std::vector <vec2> order_start;
+std::vector <vec2> order_end;
+
+float jump_length (vec2 from, vec2 to) {
+    return hypot (to.x - from.x, to.y - from.y);
 }
 
-void render (float time) {
-
-    // TODO: make unit time 1 second and incorporate variable delta time
-
-    // create the path to trace
-    prepare_path (time);
+void order_path_greedy (const std::vector <vec2> &ends) {
+    int count = ends.size () / 2;
 
-    // prepare the electron buffer
-    std::fill_n (electron_buffer, size, 0); // clear it first
-    for (float n = 0; n < 1; n += electron_delta) {
+    // grid of segment ends over their bounding box, about one segment per cell
+    vec2 low = ends[0], high = ends[0];
+    for (vec2 end : ends) {
+        low = vec2 (fmin (low.x, end.x), fmin (low.y, end.y));
+        high = vec2 (fmax (high.x, end.x), fmax (high.y, end.y));
+    }
+    int cells = std::max (1, (int) sqrt (count));
+    float cell_size = fmax (fmax (high.x - low.x, high.y - low.y) / cells, 1e-6);
+    auto cell_of = [&] (vec2 p) {
+        int x = std::min ((int) ((p.x - low.x) / cell_size), cells - 1);
+        int y = std::min ((int) ((p.y - low.y) / cell_size), cells - 1);
+        return std::make_pair (x, y);
+    };
+    std::vector <std::vector <int>> grid (cells * cells);
+    for (int i = 0; i < (int) ends.size (); i++) {
+        auto [x, y] = cell_of (ends[i]);
+        grid[y * cells + x].push_back (i);
+    }
 
-        // update the power supply
-        power_supply_out += (power_supply_in - power_supply_out) * power_supply_decay;
-        float power_supply_out_compliment = 1 - power_supply_out;
+    std::vector <char> used (count, 0);
+    path_order.clear ();
+    path_reversed.clear ();
+    int segment = 0;
+    bool reversed = false;
+    for (int position = 0; position < count; position++) {
+        path_order.push_back (segment);
+        path_reversed.push_back (reversed);
+        used[segment] = 1;
+        if (position == count - 1)
+            break;
+
+        // search rings of cells outward until no closer end can be found
+        vec2 from = ends[segment * 2 + !reversed];
+        auto [cx, cy] = cell_of (from);
+        int best = -1;
+        float best_length = INFINITY;
+        for (int ring = 0; ring < cells; ring++) {
+            if (best >= 0 && best_length <= (ring - 1) * cell_size)
+                break;
+            for (int y = cy - ring; y <= cy + ring; y++) {
+                for (int x = cx - ring; x <= cx + ring; x++) {
+                    if (x < 0 || y < 0 || x >= cells || y >= cells)
+                        continue;
+                    if (std::max (abs (x - cx), abs (y - cy)) != ring)
+                        continue;
+                    std::vector <int> &cell = grid[y * cells + x];
+                    for (int i = 0; i < (int) cell.size ();) {
+                        if (used[cell[i] / 2]) {
+                            cell[i] = cell.back ();
+                            cell.pop_back ();
+                            continue;
+                        }
+                        float length = jump_length (from, ends[cell[i]]);
+                        if (length < best_length) {
+                            best_length = length;
+                            best = cell[i];
+                        }
+                        i++;
+                    }
+                }
+            }
+        }
+        segment = best / 2;
+        reversed = best % 2 == 1;
+    }
+    path_order_age = 0;
+    path_order_cursor = 0;
+}
 
-        // add jitter to the sampling position
-        float sample = n + noise () * drawing_jitter;
+void improve_path_order () {
+    int count = path_order.size ();
+    int budget = path_optimizer_budget;
+    if (path_order_cursor >= count - 1)
+        path_order_cursor = 0;
+    for (int pass = 0; pass < path_optimizer_passes && budget > 0; pass++) {
+        bool improved = false;
+        for (int step = 0; step < count - 1 && budget > 0; step++) {
+            int i = path_order_cursor;
+            path_order_cursor = (i + 1) % (count - 1);
+            for (int j = i + 1; j < std::min (count, i + 1 + path_optimizer_window); j++) {
+                budget--;
+
+                // reversing positions i + 1 to j
+                // the frame is a loop, the beam moves from the last segment back to the first
+                int next = (j + 1) % count;
+                float before = jump_length (order_end[i], order_start[i + 1]) + jump_length (order_end[j], order_start[next]);
+                float after = jump_length (order_end[i], order_end[j]) + jump_length (order_start[i + 1], order_start[next]);
+                if (after >= before - 1e-3)
+                    continue;
+                std::reverse (path_order.begin () + i + 1, path_order.begin () + j + 1);
+                std::reverse (path_reversed.begin () + i + 1, path_reversed.begin () + j + 1);
+                std::reverse (order_start.begin () + i + 1, order_start.begin () + j + 1);
+                std::reverse (order_end.begin () + i + 1, order_end.begin () + j + 1);
+                for (int k = i + 1; k <= j; k++) {
+                    path_reversed[k] = !path_reversed[k];
+                    std::swap (order_start[k], order_end[k]);
+                }
+                improved = true;
+            }
+        }
+        if (!improved)
+            break;
+    }
+}
 
-        // sample the ideal point on the path to be traced
-        vec2 point = sample_path (sample);
+void optimize_path () {
+    TRACE_SCOPE ("optimize_path");
+    int count = path.size () / 2;
+    if (count < 3)
+        return;
+    bool repeated = path.size () == path_optimizer_input.size () &&
+        memcmp (path.data (), path_optimizer_input.data (), sizeof (vec3) * path.size ()) == 0;
+    if (repeated && !path_optimizer_output.empty ()) {
+        path = path_optimizer_output;
+        path_reordered = true;
+        return;
+    }
+    path_optimizer_input = path;
+    path_optimizer_output.clear ();
+    if (count > path_optimizer_max_segments && !repeated)
+        return;
 
-        if (color_crt_mode)
-            sample_color (sample);
+    std::vector <vec2> ends (count * 2);
+    for (int i = 0; i < count * 2; i++)
+        ends[i] = path[i].project ().map ();
 
-        // TODO: add electron gun inertia for curving and overshoots
+    if ((int) path_order.size () != count || ++path_order_age >= path_optimizer_refresh)
+        order_path_greedy (ends);
 
-        // calculate random scattering
-        float offset_radius = tan (noise () * 2) * electron_scattering;
-        float offset_angle = noise() * M_PI * 2;
-        float offset_x = cos (offset_angle) * offset_radius;
-        float offset_y = sin (offset_angle) * offset_radius;
+    order_start.resize (count);
+    order_end.resize (count);
+    for (int position = 0; position < count; position++) {
+        int segment = path_order[position];
+        bool reversed = path_reversed[position];
+        order_start[position] = ends[segment * 2 + reversed];
+        order_end[position] = ends[segment * 2 + !reversed];
+    }
+    improve_path_order ();
+
+    std::vector <vec3> ordered (count * 2);
+    for (int position = 0; position < count; position++) {
+        int segment = path_order[position];
+        bool reversed = path_reversed[position];
+        ordered[position * 2] = path[segment * 2 + reversed];
+        ordered[position * 2 + 1] = path[segment * 2 + !reversed];
+    }
+    path.swap (ordered);
+    path_optimizer_output = path;
+    path_reordered = true;
+}
 
-        // calculate final dot position
-        float x = point.x + offset_x;
-        float y = point.y + offset_y;
-        x += (center_x - x) * power_supply_out_compliment;
-        y += (center_y - y) * power_supply_out_compliment;
+// worker pool
+// the electron threads are started once and sleep between jobs, a frame runs several
+// the pool is never freed, its threads wait on it until the process exits
+struct worker_pool {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    int workers = 0;                // threads started, besides the caller
+    int generation = 0;             // counts jobs, a change wakes the workers
+    int active;                     // workers taking part in the current job
+    int busy;                       // of those, the ones not finished yet
+    void (*work) (int);
+    int count;
+    std::atomic <int> next;
+};
+worker_pool *pool = new worker_pool;
 
-        if (color_crt_mode) {
-            if (electron_guide) {
-                point.x = floor (point.x / 3) * 3;
-                point.y = floor (point.y / 4) * 4;
-                x = floor (x / 3) * 3;
-                y = floor (y / 4) * 4;
-            }
-        }
+void take_work () {
+    for (int i; (i = pool->next.fetch_add (1)) < pool->count;)
+        pool->work (i);
+}
 
-        // clip
-        // TODO: better clipping
-        if (x < 0 || y < 0 || x >= width - 2 || y >= height - 2)
+void pool_worker (int index, int generation) {
+    std::unique_lock <std::mutex> lock (pool->mutex);
+    while (true) {
+        pool->wake.wait (lock, [&] { return pool->generation != generation; });
+        generation = pool->generation;
+        if (index >= pool->active)
             continue;
+        lock.unlock ();
+        take_work ();
+        lock.lock ();
+        if (--pool->busy == 0)
+            pool->done.notify_one ();
+    }
+}
 
-        // calculate intensity and adjust for decay at this time
-        // TODO: idk a good curve, find a better one?
-        float decay_curve = 1 - n * n;
-        float intensity = intensity_per_electron * power_supply_out;
-        if (enable_phosphor_filter)
-            intensity -= intensity * phosphor_decay * decay_curve;
+// run count independent units of work on the electron threads
+// threads take units in whatever order they get to them
+// the calling thread works too; only one thread may run jobs at a time
+void run_parallel (int count, void (*work) (int)) {
+    int threads = std::min (electron_threads, count);
+    if (threads <= 1) {
+        for (int i = 0; i < count; i++)
+            work (i);
+        return;
+    }
 
-        if (color_crt_mode) {
-            // in this mode there are three electron beams in a delta gun pattern
-            int x_ = floor (point.x);
-            if (shadow_mask) {
-                if (int (x) % 3 > 0 || int (y) % 4 > 0) {
-                    continue;
-                }
-            }
-            float y_mid = y;
-            float y_side = y + 2;
-            if (x_ % 2 == 0) {
-                y_mid = y + 2;
-                y_side = y;
-            }
-            float intensity1, intensity2, intensity3;
-            if (x_ % 3 == 0) {
-                intensity1 = color_red;
-                intensity2 = color_green;
-                intensity3 = color_blue;
-            } else if (x_ % 3 == 1) {
-                intensity1 = color_blue;
-                intensity2 = color_red;
-                intensity3 = color_green;
-            } else {
-                intensity1 = color_green;
-                intensity2 = color_blue;
-                intensity3 = color_red;
-            }
-            electron_buffer[int (x) + 1 + int (y_mid)  * width] += intensity * intensity1;
-            electron_buffer[int (x)     + int (y_side) * width] += intensity * intensity2;
-            electron_buffer[int (x) + 2 + int (y_side) * width] += intensity * intensity3;
-        } else {
-            // plot the result on the electron buffer
-            electron_buffer[int (x) + int (y) * width] += intensity;
-        }
+    {
+        std::lock_guard <std::mutex> lock (pool->mutex);
+        for (; pool->workers < threads - 1; pool->workers++)
+            std::thread (pool_worker, pool->workers, pool->generation).detach ();
+        pool->work = work;
+        pool->count = count;
+        pool->next = 0;
+        pool->active = threads - 1;
+        pool->busy = threads - 1;
+        pool->generation++;
     }
+    pool->wake.notify_all ();
+    take_work ();
+    std::unique_lock <std::mutex> lock (pool->mutex);
+    pool->done.wait (lock, [] { return pool->busy == 0; });
+}
 
-    // update the phosphor buffer
-    for (int i = 0; i < size * 3; i++) {
-        float target = color_mask[i] * electron_buffer[i / 3];
-        if (enable_phosphor_filter)
-            phosphor_buffer[i] += (target - phosphor_buffer[i]) * phosphor_decay;
-        else
-            phosphor_buffer[i] = target;
+// color sampling tables
+// offsets into the source image for each scanline and each triad along a scanline
+// rebuilt every frame since the interlaced field changes which rows are used
+// this is where the source is scaled to the screen
+std::vector <int> scanline_source_offset;
+std::vector <int> triad_source_offset;
+const float *color_source;              // the image, or the decoded composite signal
+
+// composite video stage
+// each scanline is encoded into a composite signal at 4 samples per subcarrier cycle and decoded back
+// at that rate the subcarrier only takes the values 1, 0, -1, 0, so modulation is a multiply by a shifted table
+// the filters run over whole scanlines and vectorize, and scanlines are spread over the electron threads
+int composite_samples;                          // per scanline
+int composite_padding;                          // zeros on either side of a scanline, for the filters
+std::vector <float> composite_luma_filter;
+std::vector <float> composite_chroma_filter;
+std::vector <float> composite_carrier;          // cos of quarter cycles
+std::vector <int> composite_source_column;      // source offset for each sample
+std::vector <int> composite_triad_sample;       // sample at the center of each triad
+std::vector <float> composite_rgb;              // decoded color per triad per scanline
+
+thread_local std::vector <float> composite_scratch;
+
+// windowed sinc low pass, normalized to unit gain
+std::vector <float> low_pass_filter (int taps, float cutoff) {
+    std::vector <float> filter (taps);
+    float sum = 0;
+    for (int i = 0; i < taps; i++) {
+        float x = i - (taps - 1) / 2.0;
+        float sinc = x == 0 ? 1 : sin (2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+        float window = 0.5 - 0.5 * cos (2 * M_PI * (i + 1) / (taps + 1));
+        filter[i] = sinc * window;
+        sum += filter[i];
     }
+    for (float &tap : filter)
+        tap /= sum;
+    return filter;
+}
 
-    // render the phosphor buffer with bloom filter
-    glActiveTexture(GL_TEXTURE0 + 0);
-    glBindTexture (GL_TEXTURE_2D, phosphor_texture);
-    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_FLOAT, phosphor_buffer);
-    glActiveTexture(GL_TEXTURE0 + 1);
-    glBindTexture (GL_TEXTURE_2D, kernel_texture);
-    glUseProgram (program);
-    glBindVertexArray (vao);
-    glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+void generate_composite_filters () {
+    composite_samples = composite_carrier_cycles * 4;
+    composite_padding = std::max (composite_luma_taps, composite_chroma_taps) / 2;
+    composite_luma_filter = low_pass_filter (composite_luma_taps, composite_luma_cutoff);
+    composite_chroma_filter = low_pass_filter (composite_chroma_taps, composite_chroma_cutoff);
+    composite_carrier.resize (composite_samples + 4);
+    for (int i = 0; i < (int) composite_carrier.size (); i++)
+        composite_carrier[i] = i % 2 == 1 ? 0 : i % 4 == 0 ? 1 : -1;
 }
 
-std::string read_file (const char *filename) {
-    // https://stackoverflow.com/questions/18398167/how-to-copy-a-txt-file-to-a-char-array-in-c
-    std::ifstream in (filename);
-    std::string contents ((std::istreambuf_iterator <char> (in)),
-            std::istreambuf_iterator <char> ());
-    return contents;
+// out[i] = sum of filter[t] * in[i + t - taps / 2], in is padded
+// taps outermost so the inner loop is a plain multiply add over the scanline
+void apply_filter (const std::vector <float> &filter, const float *in, float *out) {
+    int taps = filter.size ();
+    in -= taps / 2;
+    for (int i = 0; i < composite_samples; i++)
+        out[i] = 0;
+    for (int t = 0; t < taps; t++) {
+        float tap = filter[t];
+        const float *shifted = in + t;
+        for (int i = 0; i < composite_samples; i++)
+            out[i] += tap * shifted[i];
+    }
 }
 
-void init_opengl () {
-    float vertices[] = {
-        -1, -1,
-        1, -1,
-        -1, 1,
-        1, 1,
-    };
+void composite_scanline (int line) {
+    int samples = composite_samples;
+    int padded = samples + composite_padding * 2;
+    composite_scratch.assign (padded * 3 + samples * 6, 0);
+    float *signal = composite_scratch.data () + composite_padding;  // padded
+    float *in_phase = signal + padded;                              // padded
+    float *quadrature = in_phase + padded;                          // padded
+    float *red = quadrature + samples + composite_padding;
+    float *green = red + samples;
+    float *blue = green + samples;
+    float *luma = blue + samples;
+    float *chroma_a = luma + samples;
+    float *chroma_b = chroma_a + samples;
+
+    // subcarrier phase in quarter cycles
+    // ntsc has 227.5 cycles per line, so the phase flips every line, and fields start 3/4 of a cycle apart
+    // pal has 283.75, so the phase moves 3/4 of a cycle every line, and v flips sign every line
+    bool pal = composite_video == signal_pal;
+    int phase = pal ? (3 * line + 2 * frame) % 4 : (2 * line + 3 * frame) % 4;
+    const float *cosine = composite_carrier.data () + phase;
+    const float *sine = composite_carrier.data () + (phase + 3) % 4;
+    float v_switch = pal && line % 2 == 1 ? -1 : 1;
+
+    // gather the source scanline
+    const float *source = &image[scanline_source_offset[line]];
+    for (int i = 0; i < samples; i++) {
+        const float *pixel = source + composite_source_column[i];
+        red[i] = pixel[0];
+        green[i] = pixel[1];
+        blue[i] = pixel[2];
+    }
 
-    glGenVertexArrays (1, &vao);
-    glBindVertexArray (vao);
+    // encode, yiq for ntsc and yuv for pal
+    for (int i = 0; i < samples; i++) {
+        float y = 0.299 * red[i] + 0.587 * green[i] + 0.114 * blue[i];
+        float a = pal ? 0.492 * (blue[i] - y) : 0.596 * red[i] - 0.274 * green[i] - 0.322 * blue[i];
+        float b = pal ? 0.877 * (red[i] - y) * v_switch : 0.211 * red[i] - 0.523 * green[i] + 0.312 * blue[i];
+        signal[i] = pal ? y + a * sine[i] + b * cosine[i] : y + a * cosine[i] + b * sine[i];
+    }
 
-    glGenBuffers (1, &vbo);
-    glBindBuffer (GL_ARRAY_BUFFER, vbo);
-    glBufferData (GL_ARRAY_BUFFER, sizeof (vertices), vertices, GL_STATIC_DRAW);
+    // decode
+    // demodulating shifts the chroma to 0 and the luma up to the subcarrier, where the low pass removes it
+    // whatever luma is near the subcarrier survives as false color, and the subcarrier left in the luma crawls
+    for (int i = 0; i < samples; i++) {
+        in_phase[i] = 2 * signal[i] * (pal ? sine[i] : cosine[i]);
+        quadrature[i] = 2 * signal[i] * (pal ? cosine[i] * v_switch : sine[i]);
+    }
+    apply_filter (composite_luma_filter, signal, luma);
+    apply_filter (composite_chroma_filter, in_phase, chroma_a);
+    apply_filter (composite_chroma_filter, quadrature, chroma_b);
+
+    // sample the decoded signal at the triads
+    int triads = composite_triad_sample.size ();
+    float *rgb = &composite_rgb[line * triads * 3];
+    for (int triad = 0; triad < triads; triad++) {
+        int i = composite_triad_sample[triad];
+        float y = luma[i];
+        float a = chroma_a[i];
+        float b = chroma_b[i];
+        if (pal) {
+            rgb[triad * 3 + 0] = fmax (0, y + 1.140 * b);
+            rgb[triad * 3 + 1] = fmax (0, y - 0.395 * a - 0.581 * b);
+            rgb[triad * 3 + 2] = fmax (0, y + 2.032 * a);
+        } else {
+            rgb[triad * 3 + 0] = fmax (0, y + 0.956 * a + 0.621 * b);
+            rgb[triad * 3 + 1] = fmax (0, y - 0.272 * a - 0.647 * b);
+            rgb[triad * 3 + 2] = fmax (0, y - 1.106 * a + 1.703 * b);
+        }
+    }
+}
 
-    glVertexAttribPointer (0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof (float), (void *) 0);
-    glEnableVertexAttribArray (0);
+// replace the color tables with ones reading the decoded signal
+void prepare_composite () {
+    TRACE_SCOPE ("composite");
+    int lines = scanline_source_offset.size ();
+    int triads = triad_source_offset.size ();
+
+    composite_source_column.resize (composite_samples);
+    for (int i = 0; i < composite_samples; i++)
+        composite_source_column[i] = std::min (i * image_width / composite_samples, image_width - 1) * 3;
+    composite_triad_sample.resize (triads);
+    for (int triad = 0; triad < triads; triad++)
+        composite_triad_sample[triad] = std::min ((int) ((triad * 3 + 1.5) / width * composite_samples), composite_samples - 1);
+
+    composite_rgb.resize (lines * triads * 3);
+    run_parallel (lines, composite_scanline);
+
+    for (int line = 0; line < lines; line++)
+        scanline_source_offset[line] = line * triads * 3;
+    for (int triad = 0; triad < triads; triad++)
+        triad_source_offset[triad] = triad * 3;
+    color_source = composite_rgb.data ();
+}
 
-    glGenTextures (1, &phosphor_texture);
+void prepare_color_tables () {
+    int lines = height / 4;
+    int triads = width / 3;
+
+    // alternate fields take alternate source rows
+    float rows_per_line = (float) image_height / lines;
+    float field_offset = frame % 2 == 0 ? 0 : rows_per_line / 2;
+    scanline_source_offset.resize (lines);
+    for (int line = 0; line < lines; line++) {
+        int y = std::min ((int) floor (line * rows_per_line + field_offset), image_height - 1);
+        scanline_source_offset[line] = y * image_width * 3;
+    }
+
+    // a partial triad at the end of a scanline reads the last column
+    triad_source_offset.resize ((width + 2) / 3);
+    for (int triad = 0; triad < (int) triad_source_offset.size (); triad++) {
+        int x = std::min (triad * image_width / std::max (triads, 1), image_width - 1);
+        triad_source_offset[triad] = x * 3;
+    }
+
+    color_source = image.data ();
+    if (composite_video != signal_rgb)
+        prepare_composite ();
+}
+
+void sample_color (int line, int triad) {
+    const float *source = &color_source[scanline_source_offset[line] + triad_source_offset[triad]];
+    color_red = source[0];
+    color_green = source[1];
+    color_blue = source[2];
+}
+
+void sample_color (float n) {
+    int lines = scanline_source_offset.size ();
+
+    // a screen under one triad high or wide has no scanlines to take a color from
+    if (lines == 0 || triad_source_offset.empty ()) {
+        color_red = color_green = color_blue = 0;
+        return;
+    }
+    float nn = n * lines;
+    int line = std::clamp ((int) nn, 0, lines - 1);    // the scanline
+    int triad = std::clamp ((int) ((nn - line) * width) / 3, 0, (int) triad_source_offset.size () - 1);
+    sample_color (line, triad);
+}
+
+// power supply response
+// the smoothing is a first order low pass, so within a stretch of constant input
+// the output after k electrons is in + (out - in) * (1 - decay)^k
+// this gives the output for any electron directly, in any order
+struct power_supply_segment {
+    int first;          // first electron of the segment
+    float in;           // power input during the segment
+    float out;          // output before the first electron
+};
+
+std::vector <power_supply_segment> power_supply_segments;
+std::vector <double> power_supply_toggles;      // wall clock times of power switch presses
+double power_supply_retain_log;                 // log (1 - power_supply_decay)
+
+// the output after k electron periods into the frame
+// during blanking the supply keeps settling even though no electrons are fired
+float power_supply_before (float k) {
+    int i = power_supply_segments.size () - 1;
+    while (power_supply_segments[i].first > k)
+        i--;
+    const power_supply_segment &segment = power_supply_segments[i];
+    return segment.in + (segment.out - segment.in) * exp ((k - segment.first) * power_supply_retain_log);
+}
+
+// lay out the power supply input for this frame
+// switch presses since the last frame are placed at the matching point in this frame
+void schedule_power_supply (double frame_start, double frame_end) {
+    power_supply_retain_log = log1p (-(double) power_supply_decay);
+    power_supply_segments.clear ();
+    power_supply_segments.push_back ({ 0, power_supply_in, power_supply_out });
+    std::sort (power_supply_toggles.begin (), power_supply_toggles.end ());
+    for (double toggle : power_supply_toggles) {
+        double fraction = frame_end > frame_start ? (toggle - frame_start) / (frame_end - frame_start) : 0;
+        int first = std::clamp ((int) (fraction * electron_count), 0, electron_count);
+        float out = power_supply_before (first);
+        power_supply_in = !power_supply_in;
+        power_supply_segments.push_back ({ first, power_supply_in, out });
+    }
+    power_supply_toggles.clear ();
+    power_supply_out = power_supply_before (electron_count);
+}
+
+// beam timeline
+// in vector mode the frame is cut into beam_steps equal steps, and each segment of the path
+// is drawn over a stretch of them as long as its electron budget, with the blanked move to it before
+// steps during moves fire no electrons, and there are just enough steps for electron_count to draw
+// the move to the first segment comes from the end of the last one, as in the previous frame
+std::vector <double> timeline_start;        // step each segment starts drawing at
+std::vector <double> timeline_steps;        // steps it draws for
+
+void prepare_timeline () {
+    TRACE_SCOPE ("timeline");
+    int segments = path.size () / 2;
+    timeline_start.resize (segments);
+    timeline_steps.resize (segments);
+    if (segments == 0) {
+        beam_steps = electron_count;
+        return;
+    }
+
+    // moves, as fractions of the frame, and segment lengths on screen
+    std::vector <float> move (segments);
+    std::vector <float> length (segments);
+    float move_total = 0;
+    double length_total = 0;
+    for (int i = 0; i < segments; i++) {
+        vec2 from = path[(i + segments - 1) % segments * 2 + 1].project ().map ();
+        vec2 start = path[i * 2].project ().map ();
+        vec2 end = path[i * 2 + 1].project ().map ();
+        float distance = hypot (start.x - from.x, start.y - from.y);
+        move[i] = distance == 0 ? 0 : blank_settle_time + distance / (blank_speed * width);
+        move_total += move[i];
+        if (light_pen_mode)
+            length[i] = fmax (pen_duration[i], 1e-6);       // as long as the pen took over it
+        else
+            length[i] = equal_segment_time ? 1 : fmax (hypot (end.x - start.x, end.y - start.y), segment_min_length);
+        length_total += length[i];
+    }
+    float move_scale = move_total > blank_max_time ? blank_max_time / move_total : 1;
+
+    // the drawing steps are the electron budget, shared out by length
+    beam_steps = ceil (electron_count / (1 - move_total * move_scale));
+    double step = 0;
+    for (int i = 0; i < segments; i++) {
+        step += move[i] * move_scale * beam_steps;
+        timeline_start[i] = step;
+        timeline_steps[i] = electron_count * length[i] / length_total;
+        step += timeline_steps[i];
+    }
+}
+
+// the segment being drawn or moved to at step k
+int timeline_segment (int k) {
+    int segment = std::upper_bound (timeline_start.begin (), timeline_start.end (), (double) k) - timeline_start.begin ();
+    return std::max (segment - 1, 0);
+}
+
+// where the deflection aims the beam at step k, and whether it is drawing
+// segment is the timeline segment for the previous step, and is moved along
+bool beam_target (int k, int &segment, vec2 &target) {
+    if (!blanked_moves) {
+        target = sample_path (k * electron_delta);
+        return true;
+    }
+    int segments = timeline_start.size ();
+    if (segments == 0) {
+        target = sample_path (0);
+        return true;
+    }
+    while (segment + 1 < segments && timeline_start[segment + 1] <= k)
+        segment++;
+    double into = k - timeline_start[segment];
+    if (into < 0) {
+        target = path[segment * 2].project ().map ();
+        return false;
+    }
+    if (into >= timeline_steps[segment]) {
+        target = path[std::min (segment * 2 + 2, (int) path.size () - 1)].project ().map ();
+        return false;
+    }
+    target = sample_segment (segment, into / timeline_steps[segment]);
+    return true;
+}
+
+// electron gun inertia
+// per axis the beam has a position and velocity, and every electron period the deflection
+// moves it toward the ideal point on the path: state = a * state + b * target
+// that is a linear recurrence, so each chunk can run it from a zero state on its own,
+// and the true state at the start of every chunk follows from a short serial pass over the chunks
+// the emission loop then runs the recurrence again from that state, in parallel across chunks
+struct gun_state {
+    float x, y;
+    float velocity_x, velocity_y;
+};
+
+double gun_a[2][2];                             // response over one electron period
+double gun_b[2];
+std::vector <gun_state> gun_chunk_start;        // state before each chunk, and after the last one
+
+// one electron period of the deflection
+void step_gun (gun_state &state, vec2 target) {
+    float x = gun_a[0][0] * state.x + gun_a[0][1] * state.velocity_x + gun_b[0] * target.x;
+    float y = gun_a[0][0] * state.y + gun_a[0][1] * state.velocity_y + gun_b[0] * target.y;
+    state.velocity_x = gun_a[1][0] * state.x + gun_a[1][1] * state.velocity_x + gun_b[1] * target.x;
+    state.velocity_y = gun_a[1][0] * state.y + gun_a[1][1] * state.velocity_y + gun_b[1] * target.y;
+    state.x = x;
+    state.y = y;
+}
+
+// exact response of position'' = w^2 (target - position) - 2 zeta w position'
+// with the target held over the period, as the exponential of the system matrix
+// with the target as a third state, by a taylor series and repeated squaring
+void generate_gun_response () {
+    double w = 2 * M_PI * gun_frequency / beam_steps;
+    double m[3][3] = {{ 0, 1, 0 }, { -w * w, -2 * gun_damping * w, w * w }, { 0, 0, 0 }};
+    int squarings = 8;
+    double r[3][3] = {{ 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }};
+    double term[3][3] = {{ 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }};
+    for (int order = 1; order < 12; order++) {
+        double next[3][3] = {};
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                for (int k = 0; k < 3; k++)
+                    next[i][j] += term[i][k] * m[k][j] / (1 << squarings) / order;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                r[i][j] += term[i][j] = next[i][j];
+    }
+    for (int s = 0; s < squarings; s++) {
+        double square[3][3] = {};
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                for (int k = 0; k < 3; k++)
+                    square[i][j] += r[i][k] * r[k][j];
+        memcpy (r, square, sizeof r);
+    }
+    for (int i = 0; i < 2; i++) {
+        gun_a[i][0] = r[i][0];
+        gun_a[i][1] = r[i][1];
+        gun_b[i] = r[i][2];
+    }
+}
+
+// the state each chunk ends in when started from rest at 0
+std::vector <gun_state> gun_chunk_end;
+
+void gun_zero_state_chunk (int chunk) {
+    int first = (long long) beam_steps * chunk / electron_chunks;
+    int last = (long long) beam_steps * (chunk + 1) / electron_chunks;
+    gun_state state = {};
+    int segment = blanked_moves ? timeline_segment (first) : 0;
+    vec2 target;
+    for (int k = first; k < last; k++) {
+        beam_target (k, segment, target);
+        step_gun (state, target);
+    }
+    gun_chunk_end[chunk] = state;
+}
+
+// find the state at the start of every chunk
+// the beam carries over from the end of the previous frame
+void prepare_gun_inertia () {
+    TRACE_SCOPE ("gun");
+    generate_gun_response ();
+    gun_chunk_end.resize (electron_chunks);
+    run_parallel (electron_chunks, gun_zero_state_chunk);
+
+    if (gun_chunk_start.empty ())
+        gun_chunk_start.assign (electron_chunks + 1, {});
+    gun_chunk_start[0] = gun_chunk_start[electron_chunks];
+    for (int chunk = 0; chunk < electron_chunks; chunk++) {
+        int length = (long long) beam_steps * (chunk + 1) / electron_chunks - (long long) beam_steps * chunk / electron_chunks;
+
+        // a to the power of the chunk length
+        double power[2][2] = {{ 1, 0 }, { 0, 1 }};
+        double base[2][2] = {{ gun_a[0][0], gun_a[0][1] }, { gun_a[1][0], gun_a[1][1] }};
+        for (; length > 0; length >>= 1) {
+            double product[2][2] = {};
+            if (length & 1) {
+                for (int i = 0; i < 2; i++)
+                    for (int j = 0; j < 2; j++)
+                        product[i][j] = power[i][0] * base[0][j] + power[i][1] * base[1][j];
+                memcpy (power, product, sizeof power);
+            }
+            for (int i = 0; i < 2; i++)
+                for (int j = 0; j < 2; j++)
+                    product[i][j] = base[i][0] * base[0][j] + base[i][1] * base[1][j];
+            memcpy (base, product, sizeof base);
+        }
+
+        gun_state start = gun_chunk_start[chunk];
+        gun_state end = gun_chunk_end[chunk];
+        gun_state &next = gun_chunk_start[chunk + 1];
+        next.x = power[0][0] * start.x + power[0][1] * start.velocity_x + end.x;
+        next.y = power[0][0] * start.y + power[0][1] * start.velocity_y + end.y;
+        next.velocity_x = power[1][0] * start.x + power[1][1] * start.velocity_x + end.velocity_x;
+        next.velocity_y = power[1][0] * start.y + power[1][1] * start.velocity_y + end.velocity_y;
+    }
+}
+
+// raster timing
+// scanline period as a fraction of the frame, including the vertical blanking
+float raster_line_period = 1;
+
+void prepare_raster_timing () {
+    int lines = height / 4;
+    float vblank_lines = lines * vblank_fraction / (1 - vblank_fraction);
+    if (interlace && frame % 2 == 1)
+        vblank_lines += 0.5;
+    raster_line_period = 1 / (lines + vblank_lines);
+}
+
+// when the beam reaches the point n along its path, as a fraction of the frame
+// each scanline is drawn during its active part, then the beam retraces during hblank
+// vblank follows the last scanline
+float raster_time (float n) {
+    if (!color_crt_mode || !raster_timing)
+        return n;
+    float nn = n * (height / 4);
+    float line = floor (nn);
+    return (line + (nn - line) * (1 - hblank_fraction)) * raster_line_period;
+}
+
+// add energy to a pixel of the electron buffer
+// atomic deposits are needed when several threads share the buffer
+template <bool atomic>
+inline void deposit_direct (int index, float energy) {
+    if (fixed_point_electrons) {
+        uint32_t amount = energy * fixed_point_scale + 0.5f;
+        if (atomic)
+            std::atomic_ref <uint32_t> (electron_fixed[index]).fetch_add (amount, std::memory_order_relaxed);
+        else
+            electron_fixed[index] += amount;
+    } else {
+        electron_buffer[index] += energy;
+    }
+}
+
+struct scatter_entry {
+    uint32_t tile;
+    uint32_t index;
+    float energy;
+};
+
+thread_local std::vector <scatter_entry> scatter_batch;
+thread_local std::vector <scatter_entry> scatter_sorted;
+thread_local std::vector <uint32_t> scatter_offsets;
+
+// sort the batched deposits by tile and apply them
+template <bool atomic>
+void flush_scatter () {
+    int tiles_x = (width + (1 << scatter_tile_shift) - 1) >> scatter_tile_shift;
+    int tiles_y = (height + (1 << scatter_tile_shift) - 1) >> scatter_tile_shift;
+    int tiles = tiles_x * tiles_y;
+
+    // counting sort on the tile index
+    scatter_offsets.assign (tiles + 1, 0);
+    for (const scatter_entry &entry : scatter_batch)
+        scatter_offsets[entry.tile + 1]++;
+    for (int tile = 0; tile < tiles; tile++)
+        scatter_offsets[tile + 1] += scatter_offsets[tile];
+    scatter_sorted.resize (scatter_batch.size ());
+    for (const scatter_entry &entry : scatter_batch)
+        scatter_sorted[scatter_offsets[entry.tile]++] = entry;
+
+    for (const scatter_entry &entry : scatter_sorted)
+        deposit_direct <atomic> (entry.index, entry.energy);
+    scatter_batch.clear ();
+}
+
+template <bool atomic>
+inline void deposit (int x, int y, float energy) {
+    if (!binned_scatter) {
+        deposit_direct <atomic> (x + y * width, energy);
+        return;
+    }
+    int tiles_x = (width + (1 << scatter_tile_shift) - 1) >> scatter_tile_shift;
+    uint32_t tile = (x >> scatter_tile_shift) + (y >> scatter_tile_shift) * tiles_x;
+    scatter_batch.push_back ({ tile, (uint32_t) (x + y * width), energy });
+    if (scatter_batch.size () == scatter_batch_size)
+        flush_scatter <atomic> ();
+}
+
+// fire the electrons of one chunk
+template <bool atomic>
+void emit_electron_chunk (int chunk) {
+    seed_noise (chunk);
+    int first = (long long) beam_steps * chunk / electron_chunks;
+    int last = (long long) beam_steps * (chunk + 1) / electron_chunks;
+    gun_state gun = gun_inertia ? gun_chunk_start[chunk] : gun_state {};
+    int segment = blanked_moves ? timeline_segment (first) : 0;
+    for (int k = first; k < last; k++) {
+
+        // the ideal point on the path to be traced, and when
+        // the beam still moves while blanked, but nothing else happens
+        vec2 point;
+        bool drawing = true;
+        float t, sample;
+        if (blanked_moves) {
+            drawing = beam_target (k, segment, point);
+            t = sample = (float) k / beam_steps;
+        } else {
+            float n = k * electron_delta;   // how far along the path
+            t = raster_time (n);
+
+            // add jitter to the sampling position
+            sample = n + noise () * drawing_jitter;
+            point = sample_path (sample);
+        }
+
+        // the beam lags behind the path
+        // without the jitter, to match the recurrence run from rest for the chunk
+        if (gun_inertia) {
+            if (!blanked_moves && drawing_jitter != 0)
+                point = sample_path (k * electron_delta);
+            step_gun (gun, point);
+            point = vec2 (gun.x, gun.y);
+        }
+        if (!drawing)
+            continue;
+
+        if (color_crt_mode)
+            sample_color (sample);
+
+        // the power supply as updated by this electron
+        float power_supply_out = power_supply_before (t * electron_count + 1);
+        float power_supply_out_compliment = 1 - power_supply_out;
+
+        // calculate random scattering
+        float offset_radius = tan (noise () * 2) * electron_scattering;
+        float offset_angle = noise() * M_PI * 2;
+        float offset_x = cos (offset_angle) * offset_radius;
+        float offset_y = sin (offset_angle) * offset_radius;
+
+        // calculate final dot position
+        float x = point.x + offset_x;
+        float y = point.y + offset_y;
+        x += (center_x - x) * power_supply_out_compliment;
+        y += (center_y - y) * power_supply_out_compliment;
+
+        if (color_crt_mode) {
+            if (electron_guide) {
+                point.x = floor (point.x / 3) * 3;
+                point.y = floor (point.y / 4) * 4;
+                x = floor (x / 3) * 3;
+                y = floor (y / 4) * 4;
+            } else if (shadow_mask) {
+                x = floor (x / 3) * 3;
+                y = floor (y / 4) * 4;
+            }
+        }
+
+        // clip
+        // TODO: better clipping
+        if (x < 0 || y < 0 || x >= width - 2 || y >= height - 2)
+            continue;
+
+        // calculate intensity and adjust for decay at this time
+        // TODO: idk a good curve, find a better one?
+        float decay_curve = 1 - t * t;
+        float intensity = intensity_per_electron * power_supply_out;
+        if (enable_phosphor_filter)
+            intensity -= intensity * phosphor_decay * decay_curve;
+        if (color_crt_mode && shadow_mask && !electron_guide)
+            intensity *= shadow_mask_transmission;
+
+        if (color_crt_mode) {
+            // in this mode there are three electron beams in a delta gun pattern
+            int x_ = floor (point.x);
+            float y_mid = y;
+            float y_side = y + 2;
+            if (x_ % 2 == 0) {
+                y_mid = y + 2;
+                y_side = y;
+            }
+            float intensity1, intensity2, intensity3;
+            if (x_ % 3 == 0) {
+                intensity1 = color_red;
+                intensity2 = color_green;
+                intensity3 = color_blue;
+            } else if (x_ % 3 == 1) {
+                intensity1 = color_blue;
+                intensity2 = color_red;
+                intensity3 = color_green;
+            } else {
+                intensity1 = color_green;
+                intensity2 = color_blue;
+                intensity3 = color_red;
+            }
+            deposit <atomic> (int (x) + 1, int (y_mid), intensity * intensity1);
+            deposit <atomic> (int (x),     int (y_side), intensity * intensity2);
+            deposit <atomic> (int (x) + 2, int (y_side), intensity * intensity3);
+        } else {
+            // plot the result on the electron buffer
+            deposit <atomic> (int (x), int (y), intensity);
+        }
+    }
+    if (binned_scatter)
+        flush_scatter <atomic> ();
+}
+
+// where the electrons aimed at a triad end up, relative to that triad
+struct raster_kernel_cell {
+    int dx;             // in triads
+    int dy;             // in scanlines
+    float weight;       // share of the triad's energy
+};
+
+std::vector <raster_kernel_cell> raster_kernel;
+
+// build the kernel by scattering electrons aimed uniformly across one triad of one scanline
+// exactly as emit_electron_chunk does, then snapping them with the electron guide
+void generate_raster_kernel () {
+    int diameter = raster_kernel_radius * 2 + 1;
+    std::vector <double> cells (diameter * diameter, 0);
+    seed_noise (0);
+    for (int i = 0; i < raster_kernel_samples; i++) {
+        float offset_radius = tan (noise () * 2) * electron_scattering;
+        float offset_angle = noise() * M_PI * 2;
+        float x = noise () * 3 + cos (offset_angle) * offset_radius;
+        float y = 2 + sin (offset_angle) * offset_radius;      // scanlines run through the middle of the triads
+        int dx = floor (x / 3);
+        int dy = floor (y / 4);
+        if (abs (dx) <= raster_kernel_radius && abs (dy) <= raster_kernel_radius)
+            cells[dx + raster_kernel_radius + (dy + raster_kernel_radius) * diameter]++;
+    }
+
+    // the rare electrons scattered further than the kernel are lost, as if clipped
+    // the faint cells that are left out are folded back into the rest to keep the brightness
+    double kept = 0, total = 0;
+    for (int i = 0; i < diameter * diameter; i++) {
+        total += cells[i];
+        if (cells[i] >= raster_kernel_threshold * raster_kernel_samples)
+            kept += cells[i];
+    }
+    raster_kernel.clear ();
+    for (int i = 0; i < diameter * diameter; i++) {
+        if (cells[i] >= raster_kernel_threshold * raster_kernel_samples) {
+            float weight = cells[i] / raster_kernel_samples * total / kept;
+            raster_kernel.push_back ({ i % diameter - raster_kernel_radius, i / diameter - raster_kernel_radius, weight });
+        }
+    }
+}
+
+// fire the raster for one chunk of scanlines
+template <bool atomic>
+void emit_raster_chunk (int chunk) {
+    int lines = height / 4;
+    int triads = width / 3;
+    int first = (long long) lines * chunk / electron_chunks;
+    int last = (long long) lines * (chunk + 1) / electron_chunks;
+    float electrons_per_triad = (float) electron_count / lines * 3 / width;
+
+    for (int line = first; line < last; line++) {
+        // scanlines are drawn top down
+        int row = height - 4 - line * 4;
+        for (int triad = 0; triad < triads; triad++) {
+
+            // the middle of the triad along the beam path
+            float n = (line + (triad * 3 + 1.5) / width) / lines;
+            float t = raster_time (n);
+            float power_supply_out = power_supply_before (t * electron_count + 1);
+            float power_supply_out_compliment = 1 - power_supply_out;
+            sample_color (line, triad);
+
+            float decay_curve = 1 - t * t;
+            float intensity = intensity_per_electron * electrons_per_triad * power_supply_out;
+            if (enable_phosphor_filter)
+                intensity -= intensity * phosphor_decay * decay_curve;
+
+            // the power supply pulls the picture towards the center
+            float source_x = triad * 3 + (center_x - triad * 3) * power_supply_out_compliment;
+            float source_y = row + (center_y - row) * power_supply_out_compliment;
+            int triad_x = floor (source_x / 3) * 3;
+            int triad_y = floor (source_y / 4) * 4;
+
+            // same delta pattern as emit_electron_chunk with the guide on
+            bool even = triad % 2 == 0;
+            for (const raster_kernel_cell &cell : raster_kernel) {
+                int x = triad_x + cell.dx * 3;
+                int y = triad_y + cell.dy * 4;
+                if (x < 0 || y < 0 || x >= width - 2 || y >= height - 2)
+                    continue;
+                int y_mid = even ? y + 2 : y;
+                int y_side = even ? y : y + 2;
+                float energy = intensity * cell.weight;
+                deposit <atomic> (x + 1, y_mid,  energy * color_red);
+                deposit <atomic> (x,     y_side, energy * color_green);
+                deposit <atomic> (x + 2, y_side, energy * color_blue);
+            }
+        }
+    }
+    if (binned_scatter)
+        flush_scatter <atomic> ();
+}
+
+// run the chunks of a frame, on several threads if the electron buffer allows it
+void run_chunks (void (*serial) (int), void (*parallel) (int)) {
+
+    // the float buffer can't be shared between threads
+    int threads = fixed_point_electrons ? std::min (electron_threads, electron_chunks) : 1;
+    if (threads == 1) {
+        for (int chunk = 0; chunk < electron_chunks; chunk++)
+            serial (chunk);
+        return;
+    }
+    run_parallel (electron_chunks, parallel);
+}
+
+// whether a frame goes through the raster kernel instead of tracing electrons
+// the kernel is the guided pattern, without the guide electrons are traced to see where they land
+bool raster_engine () {
+    return raster_fast_path && color_crt_mode && electron_guide && !light_pen_mode;
+}
+
+// fire the electron beam along the path for one frame
+void emit_electrons () {
+    TRACE_SCOPE ("electrons");
+    if (raster_engine ())
+        run_chunks (emit_raster_chunk <false>, emit_raster_chunk <true>);
+    else
+        run_chunks (emit_electron_chunk <false>, emit_electron_chunk <true>);
+}
+
+// update the phosphor buffer
+// decay, mask application and clearing the electron buffer for the next frame
+// are fused into one streaming pass over each band of rows
+void update_phosphor_rows (int first, int last) {
+    int masked_rows = color_crt_mode ? height / 4 * 4 : height;
+    for (int y = first; y < last; y++) {
+        const float *mask = color_mask + (y < masked_rows ? y % color_mask_rows : color_mask_rows) * width * 3;
+        float *phosphor = phosphor_buffer + y * width * 3;
+        for (int x = 0; x < width; x++) {
+            float energy;
+            if (fixed_point_electrons) {
+                energy = electron_fixed[y * width + x] * (float) (1 / fixed_point_scale);
+                electron_fixed[y * width + x] = 0;
+            } else {
+                energy = electron_buffer[y * width + x];
+                electron_buffer[y * width + x] = 0;
+            }
+            for (int c = 0; c < 3; c++) {
+                float target = mask[x * 3 + c] * energy;
+                if (enable_phosphor_filter)
+                    phosphor[x * 3 + c] += (target - phosphor[x * 3 + c]) * phosphor_decay;
+                else
+                    phosphor[x * 3 + c] = target;
+            }
+        }
+    }
+}
+
+int phosphor_band_rows;
+
+void update_phosphor_band (int band) {
+    int first = band * phosphor_band_rows;
+    update_phosphor_rows (first, std::min (first + phosphor_band_rows, height));
+}
+
+// the bands share no pixels, so they can run on any thread
+void update_phosphor () {
+    TRACE_SCOPE ("phosphor");
+    int bytes_per_row = width * sizeof (float) * (1 + 3);
+    phosphor_band_rows = std::max (1, phosphor_band_bytes / bytes_per_row);
+    run_parallel ((height + phosphor_band_rows - 1) / phosphor_band_rows, update_phosphor_band);
+}
+
+void upload_phosphor () {
+    TRACE_SCOPE ("upload");
+    begin_gpu_timer (gpu_upload);
+    glActiveTexture(GL_TEXTURE0 + 0);
+    glBindTexture (GL_TEXTURE_2D, phosphor_texture);
+    glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_FLOAT, phosphor_buffer);
+    end_gpu_timer ();
+}
+
+// render the phosphor buffer with bloom filter
+void draw () {
+    TRACE_SCOPE ("draw");
+    glActiveTexture(GL_TEXTURE0 + 1);
+    glBindTexture (GL_TEXTURE_2D, kernel_texture);
+    glUseProgram (program);
+    glBindVertexArray (vao);
+    begin_gpu_timer (gpu_bloom);
+    glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+    end_gpu_timer ();
+}
+
+// advance the cpu side of the simulation by one frame
+// clock is the wall clock time, used to place power switch presses within the frame
+// everything about when the beam is where in the frame
+void prepare_beam_timing (double frame_start, double frame_end) {
+    if (blanked_moves)
+        prepare_timeline ();
+    schedule_power_supply (frame_start, frame_end);
+    if (gun_inertia)
+        prepare_gun_inertia ();
+}
+
+// light pen hit detection
+// a uniform grid over the path on screen, built on the first query of each frame
+// each cell lists the segments that cross it, found by walking the cells along each segment,
+// so a query only measures the few segments near the pen however long the path is
+// and a long line costs as many entries as the cells it crosses
+// segments are clipped to the screen widened by pen_hit_radius, pens further off it see nothing
+// the cells keep their own copies of the segment ends so a query reads them in order
+// hits are reported for the segments as they were added, before the optimizer reordered them
+struct pen_hit {
+    int segment;            // in the order the segments were added
+    float along;            // how far along it on screen, from the end it was added with, 0 to 1
+    float time;             // fraction of the frame when the beam was closest to the pen
+    float distance;         // in pixels
+};
+
+bool hit_grid_valid = false;
+int hit_grid_columns;
+int hit_grid_rows;
+float hit_grid_cell;                    // cell size in pixels
+std::vector <int> hit_grid_start;       // first entry of each cell, then one past the last
+struct hit_entry {
+    int segment;
+    vec2 start;                         // on screen
+    vec2 end;
+};
+std::vector <hit_entry> hit_grid_entries;
+std::vector <vec2> hit_points;          // segment ends on screen
+
+// cells covering from..to along an axis, clamped to the grid
+void hit_cells (float from, float to, int cells, int &first, int &last) {
+    first = std::clamp ((int) floor (from / hit_grid_cell), 0, cells - 1);
+    last = std::clamp ((int) floor (to / hit_grid_cell), 0, cells - 1);
+}
+
+// clip the segment from a to b to a rectangle, false if none of it is inside
+bool clip_segment (vec2 &a, vec2 &b, vec2 low, vec2 high) {
+    float from = 0, to = 1;
+    float delta[2] = { b.x - a.x, b.y - a.y };
+    float start[2] = { a.x, a.y };
+    float lows[2] = { low.x, low.y };
+    float highs[2] = { high.x, high.y };
+    for (int axis = 0; axis < 2; axis++) {
+        if (delta[axis] == 0) {
+            if (start[axis] < lows[axis] || start[axis] > highs[axis])
+                return false;
+            continue;
+        }
+        float t0 = (lows[axis] - start[axis]) / delta[axis];
+        float t1 = (highs[axis] - start[axis]) / delta[axis];
+        from = fmax (from, fmin (t0, t1));
+        to = fmin (to, fmax (t0, t1));
+    }
+    if (from > to)
+        return false;
+    b = vec2 (start[0] + delta[0] * to, start[1] + delta[1] * to);
+    a = vec2 (start[0] + delta[0] * from, start[1] + delta[1] * from);
+    return true;
+}
+
+// call visit with each cell the segment from a to b crosses, in order
+// a grid walk: each step goes to the next cell boundary the segment meets along x or y
+template <typename F>
+void walk_hit_cells (vec2 a, vec2 b, F visit) {
+    if (!clip_segment (a, b, vec2 (-pen_hit_radius, -pen_hit_radius), vec2 (width + pen_hit_radius, height + pen_hit_radius)))
+        return;
+    float px = a.x / hit_grid_cell;
+    float py = a.y / hit_grid_cell;
+    float dx = b.x / hit_grid_cell - px;
+    float dy = b.y / hit_grid_cell - py;
+    int x = floor (px);
+    int y = floor (py);
+    int end_x = floor (b.x / hit_grid_cell);
+    int end_y = floor (b.y / hit_grid_cell);
+    int step_x = dx > 0 ? 1 : -1;
+    int step_y = dy > 0 ? 1 : -1;
+
+    // the fraction of the segment at the next boundary along each axis, and between boundaries
+    float next_x = dx == 0 ? INFINITY : ((dx > 0 ? x + 1 : x) - px) / dx;
+    float next_y = dy == 0 ? INFINITY : ((dy > 0 ? y + 1 : y) - py) / dy;
+    float delta_x = dx == 0 ? INFINITY : step_x / dx;
+    float delta_y = dy == 0 ? INFINITY : step_y / dy;
+
+    // the widened edge falls outside the grid, its cells go to the border ones
+    int last = -1;
+    int steps = abs (end_x - x) + abs (end_y - y);
+    for (int i = 0; ; i++) {
+        int cell = std::clamp (y, 0, hit_grid_rows - 1) * hit_grid_columns + std::clamp (x, 0, hit_grid_columns - 1);
+        if (cell != last)
+            visit (cell);
+        last = cell;
+        if (i == steps)
+            break;
+        if (y == end_y || (x != end_x && next_x < next_y)) {
+            x += step_x;
+            next_x += delta_x;
+        } else {
+            y += step_y;
+            next_y += delta_y;
+        }
+    }
+}
+
+void build_hit_grid () {
+    TRACE_SCOPE ("hit_grid");
+    int segments = path.size () / 2;
+    hit_points.resize (segments * 2);
+    for (int i = 0; i < segments * 2; i++)
+        hit_points[i] = path[i].project ().map ();
+
+    // about one segment per cell
+    int cells = std::clamp ((int) sqrt (segments), 1, hit_grid_max);
+    hit_grid_cell = (float) std::max (width, height) / cells;
+    hit_grid_columns = ceil (width / hit_grid_cell);
+    hit_grid_rows = ceil (height / hit_grid_cell);
+
+    // count the segments of each cell, turn the counts into starts, then fill the cells in
+    hit_grid_start.assign (hit_grid_columns * hit_grid_rows + 1, 0);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < segments; i++) {
+            vec2 a = hit_points[i * 2];
+            vec2 b = hit_points[i * 2 + 1];
+            if (pass == 0)
+                walk_hit_cells (a, b, [&] (int cell) { hit_grid_start[cell + 1]++; });
+            else
+                walk_hit_cells (a, b, [&] (int cell) { hit_grid_entries[hit_grid_start[cell]++] = { i, a, b }; });
+        }
+        if (pass == 0) {
+            for (int cell = 0; cell < hit_grid_columns * hit_grid_rows; cell++)
+                hit_grid_start[cell + 1] += hit_grid_start[cell];
+            hit_grid_entries.resize (hit_grid_start.back ());
+        } else {
+            // filling moved each start to the next cell's
+            for (int cell = hit_grid_columns * hit_grid_rows; cell > 0; cell--)
+                hit_grid_start[cell] = hit_grid_start[cell - 1];
+            hit_grid_start[0] = 0;
+        }
+    }
+    hit_grid_valid = true;
+}
+
+// when the beam is a fraction n along a segment, as a fraction of the frame
+float segment_time (int segment, float n) {
+    if (blanked_moves)
+        return (timeline_start[segment] + n * timeline_steps[segment]) / beam_steps;
+    return raster_time ((segment + n) / (path.size () / 2));
+}
+
+// the first segment the beam drew within radius pixels of the pen this frame
+// position is in normalized coordinates, like the mouse
+// ignores gun inertia, the beam is taken to be on the path
+bool light_pen_hit (vec2 position, float radius, pen_hit &hit) {
+    if (!hit_grid_valid)
+        build_hit_grid ();
+    if (hit_points.empty ())
+        return false;
+
+    vec2 pen = position.map ();
+    int x0, x1, y0, y1;
+    hit_cells (pen.x - radius, pen.x + radius, hit_grid_columns, x0, x1);
+    hit_cells (pen.y - radius, pen.y + radius, hit_grid_rows, y0, y1);
+    // a segment in several of the cells is measured again each time, which can't change the answer
+    bool found = false;
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            int cell = y * hit_grid_columns + x;
+            for (int j = hit_grid_start[cell]; j < hit_grid_start[cell + 1]; j++) {
+                // closest point of the segment
+                const hit_entry &entry = hit_grid_entries[j];
+                vec2 a = entry.start;
+                vec2 b = entry.end;
+                float dx = b.x - a.x;
+                float dy = b.y - a.y;
+                float length = dx * dx + dy * dy;
+                float n = length > 0 ? std::clamp (((pen.x - a.x) * dx + (pen.y - a.y) * dy) / length, 0.0f, 1.0f) : 0;
+                float x = a.x + dx * n - pen.x;
+                float y = a.y + dy * n - pen.y;
+                if (x * x + y * y > radius * radius)
+                    continue;
+                float time = segment_time (entry.segment, n);
+                if (!found || time < hit.time)
+                    hit = { entry.segment, n, time, sqrtf (x * x + y * y) };
+                found = true;
+            }
+        }
+    }
+
+    // from the drawn position back to the segment as it was added
+    if (found && path_reordered) {
+        if (path_reversed[hit.segment])
+            hit.along = 1 - hit.along;
+        hit.segment = path_order[hit.segment];
+    }
+    return found;
+}
+
+// cpu time of the last frame, in ms
+double simulate_time;
+double emit_time;
+
+void simulate (float time, double clock = 0) {
+    auto start = std::chrono::steady_clock::now ();
+
+    // TODO: make unit time 1 second and incorporate variable delta time
+
+    // create the path to trace
+    prepare_path (time);
+    if (path_optimizer && !color_crt_mode && !light_pen_mode)
+        optimize_path ();
+    if (color_crt_mode) {
+        prepare_color_tables ();
+        prepare_raster_timing ();
+    }
+
+    prepare_beam_timing (last_frame_clock, clock);
+    last_frame_clock = clock;
+    hit_grid_valid = false;
+
+    auto emit_start = std::chrono::steady_clock::now ();
+    emit_electrons ();
+    auto emit_end = std::chrono::steady_clock::now ();
+    update_phosphor ();
+
+    auto end = std::chrono::steady_clock::now ();
+    simulate_time = std::chrono::duration <double, std::milli> (end - start).count ();
+    emit_time = std::chrono::duration <double, std::milli> (emit_end - emit_start).count ();
+}
+
+void render (float time) {
+    collect_gpu_timers ();
+    simulate (time, glfwGetTime ());
+    upload_phosphor ();
+    draw ();
+}
+
+std::string read_file (const char *filename) {
+    // https://stackoverflow.com/questions/18398167/how-to-copy-a-txt-file-to-a-char-array-in-c
+    std::ifstream in (filename);
+    std::string contents ((std::istreambuf_iterator <char> (in)),
+            std::istreambuf_iterator <char> ());
+    return contents;
+}
+
+void resize_opengl ();
+void upload_kernel ();
+
+void init_opengl () {
+    float vertices[] = {
+        -1, -1,
+        1, -1,
+        -1, 1,
+        1, 1,
+    };
+
+    glGenVertexArrays (1, &vao);
+    glBindVertexArray (vao);
+
+    glGenBuffers (1, &vbo);
+    glBindBuffer (GL_ARRAY_BUFFER, vbo);
+    glBufferData (GL_ARRAY_BUFFER, sizeof (vertices), vertices, GL_STATIC_DRAW);
+
+    glVertexAttribPointer (0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof (float), (void *) 0);
+    glEnableVertexAttribArray (0);
+
+    glGenTextures (1, &phosphor_texture);
     glBindTexture (GL_TEXTURE_2D, phosphor_texture);
     glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
     glGenTextures (1, &kernel_texture);
     glBindTexture (GL_TEXTURE_2D, kernel_texture);
     glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexImage2D (GL_TEXTURE_2D, 0, GL_RED, bloom_kernel_diameter, bloom_kernel_diameter, 0, GL_RED, GL_FLOAT, kernel);
 
     glBindVertexArray (0);
 
+    init_gpu_timers ();
+
     // compile shaders
     GLuint vertex_shader, fragment_shader;
     int success;
@@ -585,57 +2445,953 @@ void init_opengl () {
 
     // set parameters
     glUseProgram (program);
-    glUniform1i (glGetUniformLocation (program, "kernel_diameter"), bloom_kernel_diameter);
-    glUniform1f (glGetUniformLocation (program, "brightness"), bloom_brightness);
     glUniform3f (glGetUniformLocation (program, "reflectance"), phosphor_reflectance_red, phosphor_reflectance_green, phosphor_reflectance_blue);
 
     glUniform1i (glGetUniformLocation (program, "source"), 0);
     glUniform1i (glGetUniformLocation (program, "kernel"), 1);
 
+    upload_kernel ();
+    resize_opengl ();
+}
+
+// upload the bloom kernel at the current diameter
+// a smaller kernel gathers less light, which the brightness makes up for
+void upload_kernel () {
+    float sum = generate_kernel ();
+    glBindTexture (GL_TEXTURE_2D, kernel_texture);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RED, bloom_diameter, bloom_diameter, 0, GL_RED, GL_FLOAT, kernel);
+    glUseProgram (program);
+    glUniform1i (glGetUniformLocation (program, "kernel_diameter"), bloom_diameter);
+    glUniform1f (glGetUniformLocation (program, "brightness"), sum > 0 ? bloom_brightness * bloom_kernel_sum / sum : bloom_brightness);
+}
+
+// resize the phosphor texture and viewport to the current resolution
+// the texture storage is only respecified here, each frame just updates it
+void resize_opengl () {
+    glViewport (0, 0, width, height);
+    glBindTexture (GL_TEXTURE_2D, phosphor_texture);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_FLOAT, NULL);
+    glUseProgram (program);
     glUniform2f (glGetUniformLocation (program, "resolution"), width, height);
 }
 
+// quality governor
+// the electron count follows the cpu time of the simulation and the bloom diameter the gpu time of the bloom pass
+// each only changes when its average time leaves the band between governor_low and governor_high
+// of the target, and then not again for governor_hold frames, so it settles instead of oscillating
+// the raster kernel visits every triad whatever the electron count, so there only bloom is governed
+// every decision is kept in governor and printed with the times that led to it
+int governor_max_electrons;         // the electron count asked for
+
+void report_governor (const char *knob) {
+    governor.last_change = frame;
+    governor.last_knob = knob;
+    printf ("governor: frame %d cpu %.2f ms emit %.2f ms gpu %.2f ms, %s: electrons %d bloom %d\n",
+            frame, governor.cpu_time, governor.emit_time, governor.gpu_time, knob,
+            electron_count, bloom_diameter);
+}
+
+// after each frame, gpu tells whether there is a bloom pass to govern
+void govern (bool gpu) {
+    governor.cpu_time += (simulate_time - governor.cpu_time) * governor_smoothing;
+    governor.emit_time += (emit_time - governor.emit_time) * governor_smoothing;
+    if (gpu)
+        governor.gpu_time += (gpu_stage_time[gpu_bloom] - governor.gpu_time) * governor_smoothing;
+    governor.electrons_governed = !raster_engine ();
+    if (frame - governor.last_change < governor_hold)
+        return;
+
+    // aim for the middle of the band
+    // only the emission scales with the electrons, the rest of the frame is taken as fixed
+    float high = governor_target * governor_high;
+    float low = governor_target * governor_low;
+    float middle = (high + low) / 2;
+    if (governor.electrons_governed &&
+        ((governor.cpu_time > high && electron_count > governor_min_electrons) ||
+         (governor.cpu_time < low && electron_count < governor_max_electrons))) {
+        double emit = middle - (governor.cpu_time - governor.emit_time);
+        double factor = std::clamp (emit / fmax (governor.emit_time, 1e-3), 0.5, 1.25);
+        set_electron_count (std::clamp ((int) (electron_count * factor), governor_min_electrons, governor_max_electrons));
+        report_governor ("electrons");
+    }
+
+    // bloom goes in steps of 2 to keep the kernel centered
+    if (gpu && bloom_kernel_diameter > 0) {
+        int diameter = bloom_diameter;
+        if (governor.gpu_time > high)
+            diameter = std::max (diameter - 2, std::min (governor_min_bloom, bloom_kernel_diameter));
+        else if (governor.gpu_time < low)
+            diameter = std::min (diameter + 2, bloom_kernel_diameter);
+        if (diameter != bloom_diameter) {
+            bloom_diameter = diameter;
+            upload_kernel ();
+            report_governor ("bloom");
+        }
+    }
+}
+
+// window input
+// glfw only delivers events and reads the cursor on the main thread, so that thread does nothing else
+// and frames are simulated and drawn on a render thread
+// events are queued here and applied by the render thread at the start of its next frame
+struct pending_input {
+    std::mutex mutex;
+    int width = 0;                          // framebuffer size to resize to, 0 for none
+    int height = 0;
+    std::vector <double> power_toggles;     // wall clock times of power switch presses
+    std::vector <vec2> clicks;              // light pen queries, in normalized coordinates
+    bool dump_trace = false;
+};
+pending_input pending;
+
+// on the render thread
+void apply_input () {
+    std::vector <vec2> clicks;
+    bool trace = false;
+    {
+        std::lock_guard <std::mutex> lock (pending.mutex);
+        if (pending.width > 0) {
+            set_resolution (pending.width, pending.height);
+            resize_opengl ();
+            pending.width = 0;
+        }
+        power_supply_toggles.insert (power_supply_toggles.end (), pending.power_toggles.begin (), pending.power_toggles.end ());
+        pending.power_toggles.clear ();
+        clicks.swap (pending.clicks);
+        std::swap (trace, pending.dump_trace);
+    }
+
+    // against the path of the frame on screen
+    for (vec2 click : clicks) {
+        pen_hit hit;
+        if (light_pen_hit (click, pen_hit_radius, hit))
+            printf ("light pen: segment %d, %.2f along it, at %.4f of the frame, %.1f px away\n", hit.segment, hit.along, hit.time, hit.distance);
+        else
+            printf ("light pen: no hit\n");
+    }
+#ifdef TRACE
+    if (trace)
+        dump_trace ();
+#endif
+}
+
 void on_resize (GLFWwindow *window, int width, int height) {
-    // TODO: allow for window resizing
-    //glViewport (0, 0, width, height);
+    // ignore minimizing
+    if (width == 0 || height == 0)
+        return;
+    std::lock_guard <std::mutex> lock (pending.mutex);
+    pending.width = width;
+    pending.height = height;
+}
+
+void sample_pen (GLFWwindow *window) {
+    // the window size can differ from the framebuffer size on high dpi screens
+    double x, y;
+    int window_width, window_height;
+    glfwGetCursorPos (window, &x, &y);
+    glfwGetWindowSize (window, &window_width, &window_height);
+    mouse = vec2 (x / window_width * 2 - 1, -(y / window_height * 2 - 1));
+    if (light_pen_mode)
+        push_pen_sample (mouse, glfwGetTime ());
 }
 
 void process_input (GLFWwindow *window) {
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
         glfwSetWindowShouldClose (window, true);
+    sample_pen (window);
+}
 
-    double x, y;
-    glfwGetCursorPos (window, &x, &y);
-    previous_mouse = mouse;
-    mouse = vec2 (x / width * 2 - 1, -(y / height * 2 - 1));
+void on_mouse_button (GLFWwindow *window, int button, int action, int mods) {
+    if (button != GLFW_MOUSE_BUTTON_LEFT || action != GLFW_PRESS)
+        return;
+    std::lock_guard <std::mutex> lock (pending.mutex);
+    pending.clicks.push_back (mouse);
 }
 
 void on_keyboard (GLFWwindow* window, int key, int scancode, int action, int mods) {
+    std::lock_guard <std::mutex> lock (pending.mutex);
     if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
-        power_supply_in = !power_supply_in;
+        pending.power_toggles.push_back (glfwGetTime ());
+#ifdef TRACE
+    if (key == GLFW_KEY_T && action == GLFW_PRESS)
+        pending.dump_trace = true;
+#endif
 }
 
 void load_image () {
 
-    int w, h, n;
-    unsigned char *source = stbi_load ("source.png", &w, &h, &n, 3);
-    for(int i = 0; i < w * h * n;i++){
+    int n;
+    unsigned char *source = stbi_load ("source.png", &image_width, &image_height, &n, 3);
+    if (source == NULL) {
+        std::cerr << "Could not load source.png" << std::endl;
+        exit (EXIT_FAILURE);
+    }
+    image.resize (image_width * image_height * 3);
+    for(int i = 0; i < image_width * image_height * 3;i++){
         image[i] = source[i] / 255.0;
     }
     stbi_image_free(source);
 }
 
+// svg import
+// paths, lines, polylines and polygons are flattened once at load into segment pairs for the path
+// coordinates are fitted into the normalized screen square, and transforms and styles are ignored
+// the flattened segments are kept in a binary sidecar next to the file, reused while the file
+// and the resolution it was flattened for are unchanged, so a reload is one read
+struct svg_sidecar_header {
+    char magic[8];
+    int64_t source_size;
+    int64_t source_time;
+    int width;
+    int height;
+    int64_t segment_vertices;
+};
+
+const char svg_sidecar_magic[8] = "beam03";          // bumped when the flattening changes
+
+// where svg coordinates land on screen
+float svg_scale = 1;
+vec2 svg_origin;
+
+vec3 svg_point (float x, float y) {
+    return vec3 ((x - svg_origin.x) * svg_scale, (svg_origin.y - y) * svg_scale, 0);
+}
+
+// value of name="..." in a tag, or empty
+std::string svg_attribute (const std::string &tag, const char *name) {
+    std::string key = std::string (" ") + name + "=";
+    size_t start = tag.find (key);
+    if (start == std::string::npos)
+        return "";
+    start += key.size ();
+    char quote = tag[start];
+    size_t end = tag.find (quote, start + 1);
+    if (end == std::string::npos)
+        return "";
+    return tag.substr (start + 1, end - start - 1);
+}
+
+// numbers in path data and point lists, separated by spaces, commas or signs
+const char *svg_skip (const char *c) {
+    while (*c == ' ' || *c == ',' || *c == '\t' || *c == '\n' || *c == '\r')
+        c++;
+    return c;
+}
+
+bool svg_number (const char *&c, float &value) {
+    c = svg_skip (c);
+    char *end;
+    value = strtof (c, &end);
+    if (end == c)
+        return false;
+    c = end;
+    return true;
+}
+
+// arc flags are single digits that may run into the next number
+bool svg_flag (const char *&c, bool &value) {
+    c = svg_skip (c);
+    if (*c != '0' && *c != '1')
+        return false;
+    value = *c++ == '1';
+    return true;
+}
+
+void svg_line (vec2 from, vec2 to) {
+    svg_path.push_back (svg_point (from.x, from.y));
+    svg_path.push_back (svg_point (to.x, to.y));
+}
+
+void svg_bezier (const vec2 *control, int order) {
+    vec3 points[4];
+    for (int i = 0; i <= order; i++)
+        points[i] = svg_point (control[i].x, control[i].y);
+    std::vector <vec3> flattened = { points[0] };
+    flatten_bezier (points, order, 0, flattened);
+    for (int i = 0; i + 1 < (int) flattened.size (); i++) {
+        svg_path.push_back (flattened[i]);
+        svg_path.push_back (flattened[i + 1]);
+    }
+}
+
+// endpoint arc to center form, from the svg implementation notes
+void svg_arc (vec2 from, float rx, float ry, float rotation, bool large, bool sweep, vec2 to) {
+    rx = fabs (rx);
+    ry = fabs (ry);
+    if (rx == 0 || ry == 0) {
+        svg_line (from, to);
+        return;
+    }
+    float phi = rotation * M_PI / 180;
+    float cos_phi = cos (phi);
+    float sin_phi = sin (phi);
+    float dx = (from.x - to.x) / 2;
+    float dy = (from.y - to.y) / 2;
+    float x1 = cos_phi * dx + sin_phi * dy;
+    float y1 = -sin_phi * dx + cos_phi * dy;
+
+    // radii too small to reach are scaled up
+    float lambda = x1 * x1 / (rx * rx) + y1 * y1 / (ry * ry);
+    if (lambda > 1) {
+        rx *= sqrt (lambda);
+        ry *= sqrt (lambda);
+    }
+    float numerator = rx * rx * ry * ry - rx * rx * y1 * y1 - ry * ry * x1 * x1;
+    float denominator = rx * rx * y1 * y1 + ry * ry * x1 * x1;
+    float factor = sqrt (fmax (0, numerator / denominator)) * (large == sweep ? -1 : 1);
+    float cx1 = factor * rx * y1 / ry;
+    float cy1 = -factor * ry * x1 / rx;
+    vec2 center (cos_phi * cx1 - sin_phi * cy1 + (from.x + to.x) / 2,
+                 sin_phi * cx1 + cos_phi * cy1 + (from.y + to.y) / 2);
+
+    float start = atan2 ((y1 - cy1) / ry, (x1 - cx1) / rx);
+    float end = atan2 ((-y1 - cy1) / ry, (-x1 - cx1) / rx);
+    float delta = end - start;
+    if (sweep && delta < 0)
+        delta += 2 * M_PI;
+    else if (!sweep && delta > 0)
+        delta -= 2 * M_PI;
+
+    // the axes map like the points, so the same angles trace the arc on screen
+    curve_key key = make_curve_key (curve_arc, mat4 ());
+    key.points[0] = svg_point (center.x, center.y);
+    key.points[1] = vec3 (rx * cos_phi * svg_scale, -rx * sin_phi * svg_scale, 0);
+    key.points[2] = vec3 (-ry * sin_phi * svg_scale, -ry * cos_phi * svg_scale, 0);
+    key.points[3] = vec3 (start, start + delta, 0);
+    std::vector <vec3> flattened;
+    flatten_arc (key, flattened);
+    for (int i = 0; i + 1 < (int) flattened.size (); i++) {
+        svg_path.push_back (flattened[i]);
+        svg_path.push_back (flattened[i + 1]);
+    }
+}
+
+void parse_svg_path_data (const char *c) {
+    vec2 current, start, control;
+    char command = 0;
+    char previous = 0;
+    while (*(c = svg_skip (c))) {
+        if (isalpha ((unsigned char) *c))
+            command = *c++;
+        else if (command == 0)
+            return;
+        bool relative = islower ((unsigned char) command);
+        vec2 base = relative ? current : vec2 ();
+        float v[7];
+        bool large, sweep;
+        bool ok = true;
+
+        switch (toupper ((unsigned char) command)) {
+            case 'Z':
+                if (current.x != start.x || current.y != start.y)
+                    svg_line (current, start);
+                current = start;
+                command = 0;
+                break;
+            case 'M':
+                ok = svg_number (c, v[0]) && svg_number (c, v[1]);
+                if (ok) {
+                    current = start = vec2 (base.x + v[0], base.y + v[1]);
+                    command = relative ? 'l' : 'L';     // more pairs are line segments
+                }
+                break;
+            case 'L':
+                ok = svg_number (c, v[0]) && svg_number (c, v[1]);
+                if (ok) {
+                    vec2 next (base.x + v[0], base.y + v[1]);
+                    svg_line (current, next);
+                    current = next;
+                }
+                break;
+            case 'H':
+            case 'V':
+                ok = svg_number (c, v[0]);
+                if (ok) {
+                    vec2 next = current;
+                    if (toupper ((unsigned char) command) == 'H')
+                        next.x = base.x + v[0];
+                    else
+                        next.y = (relative ? current.y : 0) + v[0];
+                    svg_line (current, next);
+                    current = next;
+                }
+                break;
+            case 'C':
+            case 'S': {
+                bool smooth = toupper ((unsigned char) command) == 'S';
+                int count = smooth ? 4 : 6;
+                for (int i = 0; i < count && ok; i++)
+                    ok = svg_number (c, v[i]);
+                if (ok) {
+                    vec2 points[4];
+                    points[0] = current;
+                    // strchr finds the terminator too, so no previous command has to be ruled out first
+                    bool reflect = previous != 0 && strchr ("CcSs", previous) != NULL;
+                    if (smooth)
+                        points[1] = reflect ? vec2 (current.x * 2 - control.x, current.y * 2 - control.y) : current;
+                    else
+                        points[1] = vec2 (base.x + v[0], base.y + v[1]);
+                    points[2] = vec2 (base.x + v[count - 4], base.y + v[count - 3]);
+                    points[3] = vec2 (base.x + v[count - 2], base.y + v[count - 1]);
+                    svg_bezier (points, 3);
+                    control = points[2];
+                    current = points[3];
+                }
+                break;
+            }
+            case 'Q':
+            case 'T': {
+                bool smooth = toupper ((unsigned char) command) == 'T';
+                int count = smooth ? 2 : 4;
+                for (int i = 0; i < count && ok; i++)
+                    ok = svg_number (c, v[i]);
+                if (ok) {
+                    vec2 points[3];
+                    points[0] = current;
+                    bool reflect = previous != 0 && strchr ("QqTt", previous) != NULL;
+                    if (smooth)
+                        points[1] = reflect ? vec2 (current.x * 2 - control.x, current.y * 2 - control.y) : current;
+                    else
+                        points[1] = vec2 (base.x + v[0], base.y + v[1]);
+                    points[2] = vec2 (base.x + v[count - 2], base.y + v[count - 1]);
+                    svg_bezier (points, 2);
+                    control = points[1];
+                    current = points[2];
+                }
+                break;
+            }
+            case 'A':
+                ok = svg_number (c, v[0]) && svg_number (c, v[1]) && svg_number (c, v[2]) &&
+                     svg_flag (c, large) && svg_flag (c, sweep) && svg_number (c, v[3]) && svg_number (c, v[4]);
+                if (ok) {
+                    vec2 next (base.x + v[3], base.y + v[4]);
+                    svg_arc (current, v[0], v[1], v[2], large, sweep, next);
+                    current = next;
+                }
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok)
+            return;         // like browsers, draw up to the first error
+        previous = command;
+    }
+}
+
+void parse_svg (const std::string &text) {
+    bool placed = false;
+    for (size_t open = text.find ('<'); open != std::string::npos; open = text.find ('<', open + 1)) {
+        size_t close = text.find ('>', open);
+        if (close == std::string::npos)
+            break;
+        std::string tag = text.substr (open, close - open);
+        for (char &c : tag)
+            if (c == '\n' || c == '\r' || c == '\t')
+                c = ' ';
+        std::string name = tag.substr (1, tag.find (' ') - 1);
+
+        // fit the view box, or the width and height, into the screen square
+        if (name == "svg" && !placed) {
+            float x = 0, y = 0, w = 0, h = 0;
+            std::string view_box = svg_attribute (tag, "viewBox");
+            const char *c = view_box.c_str ();
+            if (!(svg_number (c, x) && svg_number (c, y) && svg_number (c, w) && svg_number (c, h))) {
+                x = y = 0;
+                w = atof (svg_attribute (tag, "width").c_str ());
+                h = atof (svg_attribute (tag, "height").c_str ());
+            }
+            if (w > 0 && h > 0) {
+                svg_scale = 2 / fmax (w, h);
+                svg_origin = vec2 (x + w / 2, y + h / 2);
+            }
+            placed = true;
+        } else if (name == "path") {
+            parse_svg_path_data (svg_attribute (tag, "d").c_str ());
+        } else if (name == "line") {
+            svg_line (vec2 (atof (svg_attribute (tag, "x1").c_str ()), atof (svg_attribute (tag, "y1").c_str ())),
+                      vec2 (atof (svg_attribute (tag, "x2").c_str ()), atof (svg_attribute (tag, "y2").c_str ())));
+        } else if (name == "polyline" || name == "polygon") {
+            std::string points = svg_attribute (tag, "points");
+            const char *c = points.c_str ();
+            std::vector <vec2> vertices;
+            for (float x, y; svg_number (c, x) && svg_number (c, y);)
+                vertices.push_back (vec2 (x, y));
+            for (int i = 0; i + 1 < (int) vertices.size (); i++)
+                svg_line (vertices[i], vertices[i + 1]);
+            if (name == "polygon" && vertices.size () > 2)
+                svg_line (vertices.back (), vertices[0]);
+        }
+    }
+}
+
+void load_svg (const char *filename) {
+    struct stat source;
+    if (stat (filename, &source) != 0) {
+        std::cerr << "Could not load " << filename << std::endl;
+        exit (EXIT_FAILURE);
+    }
+    svg_sidecar_header expected = {};
+    memcpy (expected.magic, svg_sidecar_magic, sizeof expected.magic);
+    expected.source_size = source.st_size;
+    expected.source_time = source.st_mtime;
+    expected.width = width;
+    expected.height = height;
+
+    // a sidecar for the same file and resolution has the segments as they are in memory
+    std::string sidecar = std::string (filename) + ".beam";
+    std::ifstream in (sidecar, std::ios::binary);
+    svg_sidecar_header header;
+    if (in.read ((char *) &header, sizeof header)) {
+        expected.segment_vertices = header.segment_vertices;
+        if (memcmp (&header, &expected, sizeof header) == 0) {
+            svg_path.resize (header.segment_vertices);
+            if (in.read ((char *) svg_path.data (), sizeof (vec3) * svg_path.size ()))
+                return;
+        }
+    }
+
+    svg_path.clear ();
+    parse_svg (read_file (filename));
+    expected.segment_vertices = svg_path.size ();
+    std::ofstream out (sidecar, std::ios::binary);
+    out.write ((const char *) &expected, sizeof expected);
+    out.write ((const char *) svg_path.data (), sizeof (vec3) * svg_path.size ());
+    if (!out)
+        std::cerr << "Could not write " << sidecar << std::endl;
+}
+
+// microbenchmarks
+// each primitive is timed over batches of precomputed inputs at several sizes
+// outliers are rejected by median absolute deviation before averaging
+volatile float bench_sink;      // keeps results alive so the work isn't optimized away
+
+template <typename F>
+void bench (const char *name, int n, F f, int repetitions = bench_repetitions) {
+    std::vector <double> samples;
+    for (int i = 0; i < std::min (bench_warmup, repetitions); i++)
+        bench_sink = f (n);
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now ();
+        bench_sink = f (n);
+        auto end = std::chrono::steady_clock::now ();
+        samples.push_back (std::chrono::duration <double, std::nano> (end - start).count () / n);
+    }
+
+    // median and median absolute deviation
+    std::vector <double> sorted = samples;
+    std::sort (sorted.begin (), sorted.end ());
+    double median = sorted[sorted.size () / 2];
+    std::vector <double> deviations;
+    for (double sample : samples)
+        deviations.push_back (fabs (sample - median));
+    std::sort (deviations.begin (), deviations.end ());
+    double mad = deviations[deviations.size () / 2];
+
+    // mean and spread of the remaining samples
+    double sum = 0, sum_squares = 0;
+    int kept = 0;
+    for (double sample : samples) {
+        if (fabs (sample - median) > bench_outlier_cutoff * mad && mad > 0)
+            continue;
+        sum += sample;
+        sum_squares += sample * sample;
+        kept++;
+    }
+    double mean = sum / kept;
+    double deviation = sqrt (fmax (0, sum_squares / kept - mean * mean));
+
+    printf ("%-24s %8d %10.3f ns %9.3f ns %6.3f ns  %d/%d\n",
+            name, n, mean, deviation, median, kept, repetitions);
+}
+
+void run_benchmarks () {
+    printf ("%-24s %8s %13s %12s %9s  %s\n", "primitive", "inputs", "mean", "stddev", "median", "kept");
+
+    // shared inputs, sized for the largest run
+    int max_n = 0;
+    for (int n : bench_sizes)
+        max_n = std::max (max_n, n);
+    std::vector <mat4> matrices;
+    std::vector <mat4> products (max_n);
+    std::vector <vec3> points;
+    std::vector <vec2> normalized;
+    std::vector <float> samples;
+    for (int i = 0; i < max_n; i++) {
+        matrices.push_back (rotate_y (noise () * 7) * rotate_x (noise () * 7) * scale (noise (), noise (), noise ()));
+        points.push_back (vec3 (noise () * 2 - 1, noise () * 2 - 1, noise () * 2 - 1));
+        normalized.push_back (vec2 (noise () * 2 - 1, noise () * 2 - 1));
+        samples.push_back (noise () * 0.999);
+    }
+    std::vector <float> points_x, points_y, points_z;
+    for (vec3 point : points) {
+        points_x.push_back (point.x);
+        points_y.push_back (point.y);
+        points_z.push_back (point.z);
+    }
+    mesh_x.resize (max_n);
+    mesh_y.resize (max_n);
+    mesh_z.resize (max_n);
+
+    for (int n : bench_sizes) {
+        // independent products, a running one shrinks into denormals after a hundred of the scales
+        bench ("mat4::operator*", n, [&] (int n) {
+            for (int i = 0; i < n; i++)
+                products[i] = matrices[i] * matrices[i ^ 1];
+            return products[n - 1].xx;
+        });
+        bench ("vec3::operator*(mat4)", n, [&] (int n) {
+            float sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += (points[i] * matrices[i]).x;
+            return sum;
+        });
+        bench ("mat4::transform", n, [&] (int n) {
+            matrices[0].transform (n, points_x.data (), points_y.data (), points_z.data (),
+                                   mesh_x.data (), mesh_y.data (), mesh_z.data ());
+            return mesh_x[n - 1];
+        });
+        bench ("vec3::project", n, [&] (int n) {
+            float sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += points[i].project ().x;
+            return sum;
+        });
+        bench ("vec2::map", n, [&] (int n) {
+            float sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += normalized[i].map ().x;
+            return sum;
+        });
+        bench ("sample_path", n, [&] (int n) {
+            float sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += sample_path (samples[i]).x;
+            return sum;
+        });
+        bench ("sample_color", n, [&] (int n) {
+            float sum = 0;
+            for (int i = 0; i < n; i++) {
+                sample_color (samples[i]);
+                sum += color_red;
+            }
+            return sum;
+        });
+        bench ("noise", n, [&] (int n) {
+            float sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += noise ();
+            return sum;
+        });
+    }
+
+    // a terminal full of text, timed per character
+    std::string terminal;
+    for (int line = 0; line < 25; line++) {
+        for (int column = 0; column < 80; column++)
+            terminal += (char) (' ' + (line * 80 + column) % 95);
+        terminal += '\n';
+    }
+    bench ("add_text", terminal.size (), [&] (int n) {
+        path.clear ();
+        add_text (terminal.c_str (), -1, 1, 2.0 / 80);
+        return path.back ().x;
+    });
+
+    // curves flattened every time against curves reused from the cache, timed per curve
+    for (int n : bench_sizes) {
+        bool moving = false;
+        auto add_cubics = [&] (int n) {
+            path.clear ();
+            curve_cache_next = 0;
+            mat4 transform = moving ? translate (noise () * 1e-3, 0, 0) : mat4 ();
+            for (int i = 0; i < n; i++) {
+                float x = normalized[i].x;
+                float y = normalized[i].y;
+                add_cubic (vec3 (x, y, 0), vec3 (x + 0.05, y + 0.1, 0), vec3 (x + 0.1, y - 0.1, 0), vec3 (x + 0.15, y, 0), transform);
+            }
+            return path.back ().x;
+        };
+        bench ("add_cubic cached", n, add_cubics);
+        moving = true;
+        bench ("add_cubic flattened", n, add_cubics);
+    }
+
+    // light pen queries against scattered strokes, timed per segment and per query
+    // the strokes shorten as they multiply, like a detailed drawing filling the screen
+    set_resolution (1920, 1080);
+    for (int n : bench_sizes) {
+        path.clear ();
+        float stroke = 2 / sqrt (n);
+        for (int i = 0; i < n; i++) {
+            path.push_back (vec3 (normalized[i]));
+            path.push_back (vec3 (normalized[i].x + (noise () - 0.5) * stroke, normalized[i].y + (noise () - 0.5) * stroke, 0));
+        }
+        if (blanked_moves)
+            prepare_timeline ();
+        bench ("build_hit_grid", n, [&] (int n) {
+            build_hit_grid ();
+            return hit_grid_entries.size ();
+        });
+        bench ("light_pen_hit", n, [&] (int n) {
+            pen_hit hit;
+            float sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += light_pen_hit (normalized[(i * 7919) % n], pen_hit_radius, hit) ? hit.time : 0;
+            return sum;
+        });
+    }
+
+    // per frame stages, timed per pixel across resolutions
+    for (auto resolution : bench_resolutions) {
+        set_resolution (resolution[0], resolution[1]);
+        bench ("update_phosphor", size, [&] (int n) {
+            update_phosphor ();
+            return phosphor_buffer[0];
+        }, bench_stage_repetitions);
+        composite_video = signal_ntsc;
+        bench ("composite", size, [&] (int n) {
+            prepare_color_tables ();
+            return composite_rgb[0];
+        }, bench_stage_repetitions);
+        composite_video = signal_rgb;
+    }
+
+    // direct against binned scatter, timed per electron
+    // the crossover is where the binned time drops below the direct time
+    // the scanlines are laid out for the resolution, so the path is rebuilt with it
+    for (auto resolution : bench_resolutions) {
+        set_resolution (resolution[0], resolution[1]);
+        prepare_path (0);
+        prepare_color_tables ();
+        prepare_raster_timing ();
+        printf ("scatter at %dx%d\n", width, height);
+        for (int count : bench_electron_counts) {
+            set_electron_count (count);
+            binned_scatter = false;
+            bench ("electrons direct", count, [&] (int n) {
+                prepare_beam_timing (0, 0);
+                run_chunks (emit_electron_chunk <false>, emit_electron_chunk <true>);
+                return power_supply_out;
+            }, bench_stage_repetitions);
+            binned_scatter = true;
+            bench ("electrons binned", count, [&] (int n) {
+                prepare_beam_timing (0, 0);
+                run_chunks (emit_electron_chunk <false>, emit_electron_chunk <true>);
+                return power_supply_out;
+            }, bench_stage_repetitions);
+        }
+    }
+}
+
+// golden images
+// stored as pfm (portable float map) so the cpu output can be kept without quantizing
+bool write_pfm (const std::string &filename, const float *pixels, int w, int h) {
+    std::ofstream out (filename, std::ios::binary);
+    out << "PF\n" << w << " " << h << "\n-1.0\n";        // negative scale is little endian
+    out.write ((const char *) pixels, sizeof (float) * w * h * 3);
+    return out.good ();
+}
+
+bool read_pfm (const std::string &filename, std::vector <float> &pixels, int &w, int &h) {
+    std::ifstream in (filename, std::ios::binary);
+    std::string magic;
+    float scale;
+    in >> magic >> w >> h >> scale;
+    in.get ();
+    if (!in || magic != "PF" || scale >= 0)
+        return false;
+    pixels.resize (w * h * 3);
+    in.read ((char *) pixels.data (), sizeof (float) * pixels.size ());
+    return in.good ();
+}
+
+enum golden_metric {
+    metric_psnr,
+    metric_mae
+};
+
+// write the frame as the new reference, or compare it against the stored one
+// returns the process exit status
+int finish_golden (const std::string &filename, const float *pixels, bool write, golden_metric metric, float tolerance) {
+    if (write) {
+        if (!write_pfm (filename, pixels, width, height)) {
+            std::cerr << "Could not write " << filename << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Wrote " << filename << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    std::vector <float> reference;
+    int w, h;
+    if (!read_pfm (filename, reference, w, h)) {
+        std::cerr << "Could not read " << filename << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (w != width || h != height) {
+        std::cerr << filename << " is " << w << "x" << h << " but the frame is " << width << "x" << height << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double error = 0, squared_error = 0, peak = 1e-6;
+    for (int i = 0; i < size * 3; i++) {
+        double difference = pixels[i] - reference[i];
+        error += fabs (difference);
+        squared_error += difference * difference;
+        peak = fmax (peak, reference[i]);
+    }
+    double mae = error / (size * 3);
+    double mse = squared_error / (size * 3);
+    double psnr = mse > 0 ? 10 * log10 (peak * peak / mse) : INFINITY;
+
+    bool pass = metric == metric_psnr ? psnr >= tolerance : mae <= tolerance;
+    std::cout << filename << ": psnr " << psnr << " db, mae " << mae << (pass ? " ok" : " FAILED") << std::endl;
+    return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// read back the gl output as floats in the same layout as the phosphor buffer
+std::vector <float> read_framebuffer () {
+    std::vector <unsigned char> bytes (size * 3);
+    glPixelStorei (GL_PACK_ALIGNMENT, 1);
+    glReadPixels (0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, bytes.data ());
+    std::vector <float> pixels (size * 3);
+    for (int i = 0; i < size * 3; i++)
+        pixels[i] = bytes[i] / 255.0;
+    return pixels;
+}
+
+// the value following a command line flag
+const char *argument_value (int argc, const char **argv, int &i) {
+    if (i + 1 >= argc) {
+        std::cerr << "Missing value for " << argv[i] << std::endl;
+        exit (EXIT_FAILURE);
+    }
+    return argv[++i];
+}
+
 int main (int argc, const char **argv) {
 
+    bool benchmark = false;
+    bool headless = false;          // run only the cpu side, no window
+    int seed = time (0);
+    int frame_limit = 0;            // 0 runs until the window is closed
+    const char *svg_filename = NULL;
+    std::string golden_directory;
+    bool golden_write = false;
+    golden_metric metric = metric_psnr;
+    float tolerance = NAN;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp (argv[i], "--bench") == 0) {
+            benchmark = true;
+        } else if (strcmp (argv[i], "--resolution") == 0) {
+            const char *value = argument_value (argc, argv, i);
+            if (strcmp (value, "1080p") == 0) {
+                width = 1920;
+                height = 1080;
+            } else if (strcmp (value, "1440p") == 0) {
+                width = 2560;
+                height = 1440;
+            } else if (strcmp (value, "4k") == 0) {
+                width = 3840;
+                height = 2160;
+            } else if (sscanf (value, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                std::cerr << "Invalid resolution: " << value << std::endl;
+                exit (EXIT_FAILURE);
+            }
+        } else if (strcmp (argv[i], "--threads") == 0) {
+            electron_threads = std::max (1, atoi (argument_value (argc, argv, i)));
+        } else if (strcmp (argv[i], "--electrons") == 0) {
+            electron_count = std::max (1, atoi (argument_value (argc, argv, i)));
+        } else if (strcmp (argv[i], "--binned") == 0) {
+            binned_scatter = true;
+        } else if (strcmp (argv[i], "--composite") == 0) {
+            const char *name = argument_value (argc, argv, i);
+            if (strcmp (name, "ntsc") == 0) {
+                composite_video = signal_ntsc;
+            } else if (strcmp (name, "pal") == 0) {
+                composite_video = signal_pal;
+            } else {
+                std::cerr << "Unknown video signal: " << name << std::endl;
+                exit (EXIT_FAILURE);
+            }
+        } else if (strcmp (argv[i], "--svg") == 0) {
+            svg_filename = argument_value (argc, argv, i);
+        } else if (strcmp (argv[i], "--governor") == 0) {
+            governor_target = atof (argument_value (argc, argv, i));
+        } else if (strcmp (argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp (argv[i], "--seed") == 0) {
+            seed = atoi (argument_value (argc, argv, i));
+        } else if (strcmp (argv[i], "--frames") == 0) {
+            frame_limit = atoi (argument_value (argc, argv, i));
+        } else if (strcmp (argv[i], "--golden-write") == 0) {
+            golden_directory = argument_value (argc, argv, i);
+            golden_write = true;
+        } else if (strcmp (argv[i], "--golden-check") == 0) {
+            golden_directory = argument_value (argc, argv, i);
+            golden_write = false;
+        } else if (strcmp (argv[i], "--metric") == 0) {
+            const char *name = argument_value (argc, argv, i);
+            if (strcmp (name, "psnr") == 0) {
+                metric = metric_psnr;
+            } else if (strcmp (name, "mae") == 0) {
+                metric = metric_mae;
+            } else {
+                std::cerr << "Unknown metric: " << name << std::endl;
+                exit (EXIT_FAILURE);
+            }
+        } else if (strcmp (argv[i], "--tolerance") == 0) {
+            tolerance = atof (argument_value (argc, argv, i));
+        } else {
+            std::cerr << "Unknown argument: " << argv[i] << std::endl;
+            exit (EXIT_FAILURE);
+        }
+    }
+    if (std::isnan (tolerance))
+        tolerance = metric == metric_psnr ? golden_psnr_tolerance : golden_mae_tolerance;
+    if (!golden_directory.empty () && frame_limit == 0) {
+        std::cerr << "Golden images need a fixed frame count (--frames)" << std::endl;
+        exit (EXIT_FAILURE);
+    }
+
     load_image ();
-    generate_color_mask ();
-    generate_kernel ();
-    srand (time (0));
+    set_resolution (width, height);
+    set_electron_count (electron_count);
+    governor_max_electrons = electron_count;
+    generate_raster_kernel ();
+    bloom_kernel_sum = generate_kernel ();
+    generate_composite_filters ();
+    generate_font ();
+    if (svg_filename)
+        load_svg (svg_filename);
+    noise_seed = seed;
+
+    if (benchmark) {
+        prepare_path (0);
+        prepare_color_tables ();
+        prepare_raster_timing ();
+        run_benchmarks ();
+        return 0;
+    }
+
+    if (headless) {
+        for (frame = 0; frame < frame_limit; frame++) {
+            simulate (frame * fixed_timestep);
+            if (governor_target > 0)
+                govern (false);
+        }
+        if (golden_directory.empty ())
+            return 0;
+        return finish_golden (golden_directory + "/cpu.pfm", phosphor_buffer, golden_write, metric, tolerance);
+    }
 
     glfwInit();
     glfwWindowHint (GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint (GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint (GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if (!golden_directory.empty ())
+        glfwWindowHint (GLFW_VISIBLE, GLFW_FALSE);
 
     GLFWwindow *window = glfwCreateWindow (width, height, "Vector Display Simulator", NULL, NULL);
     if (window == NULL) {
@@ -650,20 +3406,52 @@ int main (int argc, const char **argv) {
         exit (EXIT_FAILURE);
     }
 
-    glViewport (0, 0, width, height);
+    // the framebuffer may be larger than requested on high dpi screens
+    int framebuffer_width, framebuffer_height;
+    glfwGetFramebufferSize (window, &framebuffer_width, &framebuffer_height);
+    if (framebuffer_width != width || framebuffer_height != height)
+        set_resolution (framebuffer_width, framebuffer_height);
+
     glfwSetFramebufferSizeCallback (window, on_resize);
     glfwSetKeyCallback (window, on_keyboard);
+    glfwSetMouseButtonCallback (window, on_mouse_button);
 
     init_opengl ();
+    glfwMakeContextCurrent (NULL);
+
+    int status = EXIT_SUCCESS;
+    std::thread renderer ([&] {
+        glfwMakeContextCurrent (window);
+        while (!glfwWindowShouldClose (window)) {
+            TRACE_SCOPE ("frame");
+            apply_input ();
+            render (frame_limit > 0 ? frame * fixed_timestep : glfwGetTime ());
+            if (governor_target > 0)
+                govern (enable_gpu_timers);
+
+            // read back the last frame before it is swapped away
+            if (frame_limit > 0 && frame == frame_limit - 1) {
+                if (!golden_directory.empty ())
+                    status = finish_golden (golden_directory + "/gl.pfm", read_framebuffer ().data (), golden_write, metric, tolerance);
+                glfwSetWindowShouldClose (window, true);
+                glfwPostEmptyEvent ();
+            }
+
+            {
+                TRACE_SCOPE ("swap");
+                glfwSwapBuffers (window);
+            }
+            frame++;
+        }
+    });
 
+    // the pen is sampled the whole time, including while the render thread waits on the swap
     while (!glfwWindowShouldClose (window)) {
+        glfwWaitEventsTimeout (light_pen_mode ? 1 / pen_sample_rate : 0.1);
         process_input (window);
-        render (glfwGetTime ());
-        glfwSwapBuffers (window);
-        glfwPollEvents ();
-        frame++;
     }
+    renderer.join ();
 
     glfwTerminate();
-    return 0;
+    return status;
 }